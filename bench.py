@@ -0,0 +1,108 @@
+'''
+Micro-benchmarks for the geoquad module.
+
+Usage: python bench.py [--table] [workload ...]
+
+With --table the BMI2 interleave path is disabled, so the lookup table/shift
+fallback is what gets measured. Decoding on that path uses shifts and masks,
+unless the module was built with the old sparse table as a baseline:
+
+	CFLAGS=-DGEOQUAD_SPARSE_DECODE python setup.py build_ext --inplace --force
+
+To look at cache behavior run a single workload under perf with each build,
+e.g.
+
+	perf stat -e L1-dcache-loads,L1-dcache-load-misses python bench.py --table parse
+
+The threads workload runs the same per-thread work on 1, 2, 4 and 8 threads
+at once. The functions it uses release the GIL, so with enough cores the
+time should stay roughly flat as threads are added.
+'''
+
+import array
+import random
+import sys
+import threading
+import time
+
+import geoquad
+
+def random_geoquads(n, seed=0):
+	rand = random.Random(seed)
+	lats = array.array('d', [rand.uniform(-89.0, 89.0) for _ in xrange(n)])
+	lngs = array.array('d', [rand.uniform(-179.0, 179.0) for _ in xrange(n)])
+	gqs, _ = geoquad.create_many(lats, lngs)
+	return gqs
+
+def bench_parse(gqs):
+	parse = geoquad.parse
+	for g in gqs:
+		parse(g)
+
+def bench_parse_many(gqs):
+	for _ in xrange(20):
+		geoquad.parse_many(gqs)
+
+def bench_dirof(gqs):
+	northof, southof, eastof, westof = geoquad.northof, geoquad.southof, geoquad.eastof, geoquad.westof
+	for g in gqs:
+		westof(southof(eastof(northof(g))))
+
+def bench_nearby(gqs):
+	nearby = geoquad.nearby
+	for g in gqs[:200]:
+		nearby(g, 25)
+
+def run_threads(func, nthreads):
+	threads = [threading.Thread(target=func) for _ in xrange(nthreads)]
+	start = time.time()
+	for t in threads:
+		t.start()
+	for t in threads:
+		t.join()
+	return time.time() - start
+
+def bench_threads(gqs):
+	lats, lngs = geoquad.center_many(gqs)
+	origins = gqs[:2000]
+	size = max(geoquad.nearby_count(g, 25) for g in origins)
+
+	def distances():
+		for _ in xrange(50):
+			geoquad.distances_from((37.77, -122.42), lats, lngs)
+
+	def nearby():
+		out = array.array('I', [0]) * size
+		for g in origins:
+			geoquad.nearby(g, 25, out=out)
+
+	for name, func in [('distances_from', distances), ('nearby', nearby)]:
+		base = run_threads(func, 1)
+		for nthreads in (1, 2, 4, 8):
+			elapsed = base if nthreads == 1 else run_threads(func, nthreads)
+			print '  %-16s %d threads %8.3f s  (%.2fx throughput)' % (name, nthreads, elapsed, nthreads * base / elapsed)
+
+WORKLOADS = [
+	('parse', bench_parse),
+	('parse_many', bench_parse_many),
+	('dirof', bench_dirof),
+	('nearby', bench_nearby),
+	('threads', bench_threads),
+]
+
+def main(args):
+	if '--table' in args:
+		args.remove('--table')
+		geoquad.set_bmi2(False)
+		print 'decode: %s' % ('sparse table' if geoquad.SPARSE_DECODE else 'shifts')
+	names = args or [name for name, _ in WORKLOADS]
+	gqs = random_geoquads(200000)
+	for name, func in WORKLOADS:
+		if name not in names:
+			continue
+		start = time.time()
+		func(gqs)
+		print '%-12s %8.3f s' % (name, time.time() - start)
+
+if __name__ == '__main__':
+	main(sys.argv[1:])
@@ -1,124 +1,443 @@
 #include <Python.h>
+#include <pthread.h>
 
-#include "data.h"
+#include "libgeoquad.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <math.h>
 #include <assert.h>
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define LONGITUDE_MIN  -180.0
-#define LONGITUDE_MAX   180.0
-#define LATITUDE_MIN    -90.0
-#define LATITUDE_MAX     90.0
+#define TO_RADIANS(x)   (x * M_PI / 180.0)
 
-#define EARTH_RADIUS_MI 3958.8641024047724
 
-#define MILES_PER_LATITUDE 68.70795454545454
+/***************************
+ * THREAD POOL
+ *
+ * Large batches are split across a pool of persistent worker threads, which
+ * are started the first time they're needed. A batch of n items is cut into
+ * chunks, and each thread (the caller included) is handed a contiguous run
+ * of them as a (next, end) pair packed into one 64 bit word. A thread takes
+ * chunks from the front of its own run, and once that's empty steals from
+ * the back of the others', each take being a single compare and swap.
+ *
+ * Only one batch uses the pool at a time; a batch that finds it busy, or is
+ * smaller than two chunks, just runs on the calling thread.
+ **************************/
 
-/* Unfortunately, in C we have (1 / 0.05 ) != 20
- * This causes incompatibilites with the current Python code.
- */
-#define GEOQUAD_STEP     0.05
-#define GEOQUAD_INV      20
-#define GEOQUAD_FUZZ     (GEOQUAD_STEP * 0.70710678118654757)
+#define POOL_MAX_THREADS  64
 
-/* Interleaved ones and zeroes, LSB = 1 */
-#define INTER16L 0x5555
-#define INTER32L 0x55555555
+/* Runs items [@lo, @hi) of the batch described by @arg */
+typedef void (*pool_fn)(void *arg, size_t lo, size_t hi);
 
-/* Interleaved ones and zeroes, MSB = 1 */
-#define INTER16M 0xAAAA
-#define INTER32M 0xAAAAAAAA
+typedef struct {
+	volatile uint64_t run;  /* next chunk << 32 | end chunk */
+	char pad[56];           /* keep runs on separate cache lines */
+} pool_slot;
 
-#define TO_RADIANS(x)   (x * M_PI / 180.0)
+static struct {
+	pthread_mutex_t busy;   /* held by the batch using the pool */
+	pthread_mutex_t lock;   /* protects everything below but the slots */
+	pthread_cond_t work, done;
+	pthread_t threads[POOL_MAX_THREADS];
+	unsigned long seen[POOL_MAX_THREADS];  /* last batch each worker ran */
+	int started;            /* threads running, counting the caller */
+	int size;               /* threads to use, counting the caller */
+	int stop;
+	unsigned long generation;
+	int pending;            /* workers yet to finish this batch */
 
-/* A half interleave/ */
-static const inline uint32_t interleave_half(uint16_t x)
-{
-	return (morton_forward[x >> 8] << 16) | morton_forward[x & 0xFF];
-}
+	pool_fn fn;
+	void *arg;
+	size_t n, grain;
+	int nslots;
+	pool_slot slots[POOL_MAX_THREADS];
+} pool = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+};
 
-/* A full interleave */
-static inline uint32_t interleave_full(uint16_t x, uint16_t y)
+/* Takes a chunk from the front of @s, or the back if @steal */
+static int
+pool_take(pool_slot *s, int steal, uint32_t *chunk)
 {
-	return interleave_half(x) | (interleave_half(y) << 1);
+	uint64_t run;
+	uint32_t next, end;
+
+	for (;;) {
+		run = s->run;
+		next = (uint32_t) (run >> 32);
+		end = (uint32_t) run;
+		if (next >= end)
+			return 0;
+		if (steal) {
+			if (__sync_bool_compare_and_swap(&s->run, run, ((uint64_t) next << 32) | (end - 1))) {
+				*chunk = end - 1;
+				return 1;
+			}
+		} else if (__sync_bool_compare_and_swap(&s->run, run, ((uint64_t) (next + 1) << 32) | end)) {
+			*chunk = next;
+			return 1;
+		}
+	}
 }
 
-/* A half deinterleave */
-static inline uint16_t deinterleave_half(uint32_t z)
+/* Runs chunks of the current batch as slot @self until there are none left */
+static void
+pool_work(int self)
 {
-	return morton_sparse[z & INTER16L] | (morton_sparse[(z >> 16) & INTER16L] << 8);
+	uint32_t chunk;
+	size_t lo, hi;
+	int i, t;
+
+	for (i = 0; i < pool.nslots; i++) {
+		t = (self + i) % pool.nslots;
+		while (pool_take(&pool.slots[t], t != self, &chunk)) {
+			lo = chunk * pool.grain;
+			hi = (lo + pool.grain < pool.n) ? lo + pool.grain : pool.n;
+			pool.fn(pool.arg, lo, hi);
+		}
+	}
 }
 
-/* Deinterleave z into x and y */
-static inline void deinterleave_full(uint32_t z, uint16_t *x, uint16_t *y)
+static void*
+pool_worker(void *arg)
 {
-	*x = deinterleave_half(z);
-	*y = deinterleave_half(z>>1);
+	int self = (int) (intptr_t) arg;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while ((pool.generation == pool.seen[self]) && !pool.stop)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		if (pool.stop)
+			break;
+		pool.seen[self] = pool.generation;
+		if (self < pool.nslots) {
+			pthread_mutex_unlock(&pool.lock);
+			pool_work(self);
+			pthread_mutex_lock(&pool.lock);
+		}
+		if (!--pool.pending)
+			pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
 }
 
-/* TODO: there's something fishy about these functions... */
-static inline double half_to_lng(uint16_t lng16)
+/* The number of threads to use for a pool size of @n (0 for one per CPU) */
+static int
+pool_size_for(int n)
 {
-	return (lng16 * GEOQUAD_STEP) + (LONGITUDE_MIN / 2);
+	long cpus;
+
+	if (n <= 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = (cpus > 0) ? (int) cpus : 1;
+	}
+	return (n > POOL_MAX_THREADS) ? POOL_MAX_THREADS : n;
 }
 
-static inline double half_to_lat(uint16_t lat16)
+/* Stops the worker threads and sets the pool size to @n threads (0 for one
+ * per CPU). The workers are started again by the next batch. */
+static void
+pool_resize(int n)
 {
-	return (lat16 * GEOQUAD_STEP) + (LATITUDE_MIN * 2);
+	int t;
+
+	pthread_mutex_lock(&pool.busy);
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+	for (t = 1; t < pool.started; t++)
+		pthread_join(pool.threads[t], NULL);
+	pool.started = 0;
+	pool.stop = 0;
+	pool.size = pool_size_for(n);
+	pthread_mutex_unlock(&pool.busy);
 }
 
-static inline uint16_t lng_to_half(double lng)
+/* The worker threads don't exist in a forked child, and the locks may have
+ * been held by threads that don't either */
+static void
+pool_atfork_child(void)
 {
-	return (uint16_t) ((lng - LONGITUDE_MIN) * GEOQUAD_INV);
+	pthread_mutex_init(&pool.busy, NULL);
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.done, NULL);
+	pool.started = 0;
+	pool.stop = 0;
+	pool.pending = 0;
 }
 
-static inline uint16_t lat_to_half(double lat)
+/* Runs @fn over items [0, @n) of @arg in chunks of @grain items, spread
+ * across the pool. @fn must not touch any Python objects, and this should
+ * be called without the GIL. */
+static void
+pool_run(pool_fn fn, void *arg, size_t n, size_t grain)
 {
-	return (uint16_t) ((lat - LATITUDE_MIN) * GEOQUAD_INV);
+	size_t chunks, c;
+	int t, nslots;
+
+	/* Chunk numbers have to fit in 32 bits */
+	if (grain < n / UINT32_MAX + 1)
+		grain = n / UINT32_MAX + 1;
+	chunks = (n + grain - 1) / grain;
+	if ((chunks < 2) || (pool.size <= 1) || pthread_mutex_trylock(&pool.busy)) {
+		fn(arg, 0, n);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	if (!pool.started)
+		pool.started = 1;
+	while (pool.started < pool.size) {
+		pool.seen[pool.started] = pool.generation;
+		if (pthread_create(&pool.threads[pool.started], NULL, pool_worker, (void *) (intptr_t) pool.started))
+			break;
+		pool.started++;
+	}
+	nslots = ((size_t) pool.started < chunks) ? pool.started : (int) chunks;
+	for (t = 0; t < nslots; t++) {
+		c = chunks * t / nslots;
+		pool.slots[t].run = ((uint64_t) c << 32) | (chunks * (t + 1) / nslots);
+	}
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.n = n;
+	pool.grain = grain;
+	pool.nslots = nslots;
+	pool.pending = pool.started - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	pool_work(0);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.pending)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+	pthread_mutex_unlock(&pool.busy);
 }
 
 /***************************
- * DIRECTIONAL FUNCTIONS
+ * BUFFER HELPERS
  *
- * These all take a qeoquad and return another geoquad north, south, east or
- * west of the given geoquad. These functions are much faster than parsing and
- * recreating a geoquad.
+ * The batch functions (the *_many functions) work on any object exporting a
+ * contiguous buffer of fixed size items, e.g. array.array, numpy arrays,
+ * memoryviews or bytearrays. In Python 2 array.array only implements the old
+ * buffer interface, so that's accepted as well.
  *
- * TODO: as a small optimization, we could check here if the last digit needs
- * to be flipped. This will be faster half of the time for "random" usage.
+ * The kernels run without the GIL. Objects using the old buffer interface
+ * aren't locked against resizing while we hold a pointer into them, so any
+ * Python thread could free the memory under a kernel (e.g. with
+ * array.append). Inputs from such objects that are big enough for the GIL
+ * to be released are copied into a bytearray, which is locked while
+ * exported; everything else from them is used in place with the GIL kept
+ * (see view_nogil).
  **************************/
 
-static inline uint32_t quad_northof(uint32_t gq)
+/* Releasing and retaking the GIL costs more than a small batch, so batches
+ * of fewer items than this keep it */
+#define NOGIL_MIN_ITEMS  1024
+
+#define BEGIN_ALLOW_THREADS_FOR(n) BEGIN_ALLOW_THREADS_IF((n) >= NOGIL_MIN_ITEMS)
+
+/* Releases the GIL if @cond holds; either is closed by END_ALLOW_THREADS_FOR */
+#define BEGIN_ALLOW_THREADS_IF(cond) { \
+	PyThreadState *_save = (cond) ? PyEval_SaveThread() : NULL;
+#define END_ALLOW_THREADS_FOR \
+	if (_save) \
+		PyEval_RestoreThread(_save); \
+	}
+
+/* Batch kernels run on the thread pool in chunks of this many items, so
+ * batches of fewer than twice as many stay on the calling thread */
+#define BATCH_GRAIN  16384
+
+/* The arguments of a batch kernel, for running it a chunk at a time */
+typedef struct {
+	const double *lats, *lngs;
+	const double *lats2, *lngs2;  /* haversine_many's second points */
+	const uint32_t *gqs;
+	double lat, lng, radius, offset;
+	void *out, *out2;
+	size_t count;                 /* summed over the chunks */
+} batch_args;
+
+/* The array.array type, imported when the module is initialized */
+static PyObject *array_type;
+
+/* Marks (in Py_buffer.internal) views pointing straight into objects using
+ * the old buffer interface */
+static char old_buffer_mark;
+
+/* Whether the GIL can be released while writing to @view. That's the case
+ * unless it's an object using the old buffer interface which other threads
+ * can get at. */
+static inline int
+view_nogil(const Py_buffer *view)
+{
+	return view->internal != &old_buffer_mark;
+}
+
+/* Checks that a PEP 3118 format string describes one of the single item
+ * formats in @formats, in native byte order.
+ */
+static int
+buffer_format_ok(const char *format, const char *formats)
 {
-	uint16_t lng = deinterleave_half(gq >> 1);
-	return (gq & INTER32L) | (interleave_half(lng + 1) << 1);
+	if (format == NULL)
+		format = "B";
+	if ((*format == '@') || (*format == '='))
+		format++;
+#ifndef WORDS_BIGENDIAN
+	else if (*format == '<')
+		format++;
+#endif
+	return (format[0] != '\0') && (format[1] == '\0') && (strchr(formats, format[0]) != NULL);
 }
 
-static inline uint32_t quad_southof(uint32_t gq)
+/* Get a contiguous view of @obj whose items are @itemsize bytes and of one
+ * of the types in @formats (struct module codes). On failure an exception is
+ * set mentioning @name and -1 is returned. The view must be released with
+ * PyBuffer_Release.
+ */
+static int
+get_buffer(PyObject *obj, Py_buffer *view, const char *name, const char *formats, Py_ssize_t itemsize, int writable)
 {
-	uint16_t lng = deinterleave_half(gq >> 1);
-	return (gq & INTER32L) | (interleave_half(lng - 1) << 1);
+	PyObject *typecode, *copy;
+	Py_ssize_t len;
+	void *buf;
+	int ok;
+
+	if (PyObject_CheckBuffer(obj)) {
+		if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0)) == -1)
+			return -1;
+		if ((view->itemsize != itemsize) || !buffer_format_ok(view->format, formats)) {
+			PyErr_Format(PyExc_TypeError, "%s must be a buffer of '%s' items", name, formats);
+			PyBuffer_Release(view);
+			return -1;
+		}
+		return 0;
+	}
+
+	/* Fall back to the old buffer interface. There's no format information,
+	 * but array.array (the interesting case) has a typecode we can check.
+	 * Anything else (e.g. a str) can't be told apart from raw bytes, so
+	 * it's rejected. */
+	if (writable) {
+		if (PyObject_AsWriteBuffer(obj, &buf, &len) == -1)
+			return -1;
+	} else {
+		if (PyObject_AsReadBuffer(obj, (const void **) &buf, &len) == -1)
+			return -1;
+	}
+	if ((typecode = PyObject_GetAttrString(obj, "typecode")) != NULL) {
+		ok = PyString_Check(typecode) && (PyString_GET_SIZE(typecode) == 1) && (strchr(formats, PyString_AS_STRING(typecode)[0]) != NULL);
+		Py_DECREF(typecode);
+		if (ok) {
+			typecode = PyObject_GetAttrString(obj, "itemsize");
+			ok = (typecode != NULL) && (PyInt_AsLong(typecode) == itemsize);
+			Py_XDECREF(typecode);
+		}
+	} else {
+		PyErr_Clear();
+		ok = 0;
+	}
+	if (!ok) {
+		PyErr_Format(PyExc_TypeError, "%s must be a buffer of '%s' items", name, formats);
+		return -1;
+	}
+
+	/* Inputs of at least NOGIL_MIN_ITEMS items, which the batch functions
+	 * read without the GIL, are read from a copy that stays put whatever
+	 * happens to @obj meanwhile. That costs a pass over the data but lets
+	 * other threads run during the kernel. Smaller inputs, like outputs,
+	 * are used in place and their callers keep the GIL. */
+	if (!writable && (len / itemsize >= NOGIL_MIN_ITEMS)) {
+		if (!(copy = PyByteArray_FromStringAndSize(buf, len)))
+			return -1;
+		ok = PyObject_GetBuffer(copy, view, PyBUF_SIMPLE);
+		Py_DECREF(copy);
+		if (ok == -1)
+			return -1;
+		view->itemsize = itemsize;
+		view->readonly = 1;
+		return 0;
+	}
+
+	memset(view, 0, sizeof(*view));
+	Py_INCREF(obj);
+	view->obj = obj;
+	view->buf = buf;
+	view->len = len;
+	view->itemsize = itemsize;
+	view->readonly = !writable;
+	view->ndim = 1;
+	view->internal = &old_buffer_mark;
+	return 0;
 }
 
-static inline uint32_t quad_eastof(uint32_t gq)
+/* Returns a new zeroed array.array of @n items with the given typecode */
+static PyObject*
+new_array(char typecode, Py_ssize_t n)
 {
-	uint16_t lat = deinterleave_half(gq);
-	return (gq & INTER32M) | interleave_half(lat + 1);
+	PyObject *one, *ret;
+
+	if (!(one = PyObject_CallFunction(array_type, "c[i]", typecode, 0)))
+		return NULL;
+	ret = PySequence_Repeat(one, n);
+	Py_DECREF(one);
+	return ret;
 }
 
-static inline uint32_t quad_westof(uint32_t gq)
+/* Get an output buffer of at least @n items. If @obj is None a new array of
+ * the given typecode is created and returned through @obj_out, otherwise a
+ * new reference to @obj is returned there.
+ */
+static int
+get_out_buffer(PyObject *obj, PyObject **obj_out, Py_buffer *view, const char *name, char typecode, const char *formats, Py_ssize_t itemsize, Py_ssize_t n)
 {
-	uint16_t lat = deinterleave_half(gq);
-	return (gq & INTER32M) | interleave_half(lat - 1);
+	int created = (obj == NULL) || (obj == Py_None);
+
+	if (created) {
+		if (!(obj = new_array(typecode, n)))
+			return -1;
+	} else {
+		Py_INCREF(obj);
+	}
+	if (get_buffer(obj, view, name, formats, itemsize, 1) == -1) {
+		Py_DECREF(obj);
+		return -1;
+	}
+	/* No other thread has a reference to an array we just created */
+	if (created)
+		view->internal = NULL;
+	if (view->len / itemsize < n) {
+		PyErr_Format(PyExc_ValueError, "%s is too small (%zd items, need %zd)", name, view->len / itemsize, n);
+		PyBuffer_Release(view);
+		Py_DECREF(obj);
+		return -1;
+	}
+	*obj_out = obj;
+	return 0;
 }
 
 static PyObject*
 geoquad_create(PyObject *self, PyObject *args)
 {
-	uint16_t normal_lat, normal_lng;
 	uint32_t result;
 	char *err_msg;
 	double lng, lat;
@@ -126,29 +445,83 @@ geoquad_create(PyObject *self, PyObject *args)
 	if (!PyArg_ParseTuple(args, "dd", &lat, &lng))
 		return NULL;
 
-	if ((lat < LATITUDE_MIN) || (lat > LATITUDE_MAX)) {
+	if (!gq_lat_in_range(lat)) {
 		if (!(err_msg = PyMem_Malloc(128)))
 			return PyErr_NoMemory();
-		sprintf(err_msg, "Invalid latitude (%1.2f); should be in range [%3.1f, %3.1f]", lat, LATITUDE_MIN, LATITUDE_MAX);
+		sprintf(err_msg, "Invalid latitude (%1.2f); should be in range [%3.1f, %3.1f]", lat, GEOQUAD_LATITUDE_MIN, GEOQUAD_LATITUDE_MAX);
 		PyErr_SetString(PyExc_ValueError, err_msg);
 		PyMem_Free(err_msg);
 		return NULL;
 	}
-	if ((lng < LONGITUDE_MIN) || (lng > LONGITUDE_MAX)) {
+	if (!gq_lng_in_range(lng)) {
 		if (!(err_msg = PyMem_Malloc(128)))
 			return PyErr_NoMemory();
-		sprintf(err_msg, "Invalid longitude (%1.2f); should be in range [%3.1f, %3.1f]", lng, LONGITUDE_MIN, LONGITUDE_MAX);
+		sprintf(err_msg, "Invalid longitude (%1.2f); should be in range [%3.1f, %3.1f]", lng, GEOQUAD_LONGITUDE_MIN, GEOQUAD_LONGITUDE_MAX);
 		PyErr_SetString(PyExc_ValueError, err_msg);
 		PyMem_Free(err_msg);
 		return NULL;
 	}
-	normal_lat = (uint16_t) ((lat - LATITUDE_MIN) * GEOQUAD_INV);
-	normal_lng = (uint16_t) ((lng - LONGITUDE_MIN) * GEOQUAD_INV);
 
-	result = interleave_full(normal_lat, normal_lng);
+	result = gq_interleave_full(gq_lat_to_half(lat), gq_lng_to_half(lng));
 	return PyInt_FromLong((long) result);
 }
 
+
+static void
+create_chunk(void *arg, size_t lo, size_t hi)
+{
+	batch_args *a = arg;
+
+	gq_create_many(a->lats + lo, a->lngs + lo, (uint32_t *) a->out + lo, (uint8_t *) a->out2 + lo, hi - lo);
+}
+
+static PyObject*
+geoquad_create_many(PyObject *self, PyObject *args, PyObject *kw)
+{
+	PyObject *lats_obj, *lngs_obj, *out_obj = NULL, *errors, *ret = NULL;
+	Py_buffer lats, lngs, out;
+	Py_ssize_t n;
+	batch_args a;
+
+	static char *kwlist[] = {"lats", "lngs", "out", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "OO|O", kwlist, &lats_obj, &lngs_obj, &out_obj))
+		return NULL;
+
+	if (get_buffer(lats_obj, &lats, "lats", "d", sizeof(double), 0) == -1)
+		return NULL;
+	if (get_buffer(lngs_obj, &lngs, "lngs", "d", sizeof(double), 0) == -1)
+		goto release_lats;
+
+	n = lats.len / sizeof(double);
+	if (lngs.len / sizeof(double) != n) {
+		PyErr_SetString(PyExc_ValueError, "lats and lngs must have the same length");
+		goto release_lngs;
+	}
+	if (get_out_buffer(out_obj, &out_obj, &out, "out", 'I', "IL", sizeof(uint32_t), n) == -1)
+		goto release_lngs;
+	if (!(errors = PyByteArray_FromStringAndSize(NULL, n)))
+		goto release_out;
+
+	a.lats = lats.buf;
+	a.lngs = lngs.buf;
+	a.out = out.buf;
+	a.out2 = PyByteArray_AS_STRING(errors);
+	BEGIN_ALLOW_THREADS_FOR((view_nogil(&lats) && view_nogil(&lngs) && view_nogil(&out)) ? n : 0)
+	pool_run(create_chunk, &a, n, BATCH_GRAIN);
+	END_ALLOW_THREADS_FOR
+	ret = Py_BuildValue("(ON)", out_obj, errors);
+
+release_out:
+	PyBuffer_Release(&out);
+	Py_DECREF(out_obj);
+release_lngs:
+	PyBuffer_Release(&lngs);
+release_lats:
+	PyBuffer_Release(&lats);
+	return ret;
+}
+
 static PyObject*
 geoquad_parse(PyObject *self, PyObject *args)
 {
@@ -163,9 +536,9 @@ geoquad_parse(PyObject *self, PyObject *args)
 	if ((ret = PyTuple_New(2)) == NULL)
 		return NULL;
 
-	deinterleave_full((uint32_t) geoquad, &half_lat, &half_lng);
-	lat = ((half_lat * GEOQUAD_STEP) + LATITUDE_MIN);
-	lng = ((half_lng * GEOQUAD_STEP) + LONGITUDE_MIN);
+	gq_deinterleave_full((uint32_t) geoquad, &half_lat, &half_lng);
+	lat = ((half_lat * GEOQUAD_STEP) + GEOQUAD_LATITUDE_MIN);
+	lng = ((half_lng * GEOQUAD_STEP) + GEOQUAD_LONGITUDE_MIN);
 
 	PyTuple_SetItem(ret, 0, PyFloat_FromDouble(lat));
 	PyTuple_SetItem(ret, 1, PyFloat_FromDouble(lng));
@@ -186,15 +559,77 @@ geoquad_center(PyObject *self, PyObject *args)
 	if ((ret = PyTuple_New(2)) == NULL)
 		return NULL;
 
-	deinterleave_full((uint32_t) geoquad, &half_lat, &half_lng);
-	lat = ((half_lat * GEOQUAD_STEP) + LATITUDE_MIN) + GEOQUAD_STEP / 2;
-	lng = ((half_lng * GEOQUAD_STEP) + LONGITUDE_MIN) + GEOQUAD_STEP / 2;
+	gq_deinterleave_full((uint32_t) geoquad, &half_lat, &half_lng);
+	lat = ((half_lat * GEOQUAD_STEP) + GEOQUAD_LATITUDE_MIN) + GEOQUAD_STEP / 2;
+	lng = ((half_lng * GEOQUAD_STEP) + GEOQUAD_LONGITUDE_MIN) + GEOQUAD_STEP / 2;
 
 	PyTuple_SetItem(ret, 0, PyFloat_FromDouble(lat));
 	PyTuple_SetItem(ret, 1, PyFloat_FromDouble(lng));
 	return ret;
 }
 
+
+static void
+decode_chunk(void *arg, size_t lo, size_t hi)
+{
+	batch_args *a = arg;
+
+	gq_decode_many(a->gqs + lo, (double *) a->out + lo, (double *) a->out2 + lo, hi - lo, a->offset);
+}
+
+/* Common implementation of parse_many and center_many */
+static PyObject*
+decode_many(PyObject *args, PyObject *kw, double offset)
+{
+	PyObject *gqs_obj, *lats_obj = NULL, *lngs_obj = NULL, *ret = NULL;
+	Py_buffer gqs, lats, lngs;
+	Py_ssize_t n;
+	batch_args a;
+
+	static char *kwlist[] = {"geoquads", "lats", "lngs", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "O|OO", kwlist, &gqs_obj, &lats_obj, &lngs_obj))
+		return NULL;
+
+	if (get_buffer(gqs_obj, &gqs, "geoquads", "IL", sizeof(uint32_t), 0) == -1)
+		return NULL;
+	n = gqs.len / sizeof(uint32_t);
+	if (get_out_buffer(lats_obj, &lats_obj, &lats, "lats", 'd', "d", sizeof(double), n) == -1)
+		goto release_gqs;
+	if (get_out_buffer(lngs_obj, &lngs_obj, &lngs, "lngs", 'd', "d", sizeof(double), n) == -1)
+		goto release_lats;
+
+	a.gqs = gqs.buf;
+	a.out = lats.buf;
+	a.out2 = lngs.buf;
+	a.offset = offset;
+	BEGIN_ALLOW_THREADS_FOR((view_nogil(&gqs) && view_nogil(&lats) && view_nogil(&lngs)) ? n : 0)
+	pool_run(decode_chunk, &a, n, BATCH_GRAIN);
+	END_ALLOW_THREADS_FOR
+	ret = PyTuple_Pack(2, lats_obj, lngs_obj);
+
+	PyBuffer_Release(&lngs);
+	Py_DECREF(lngs_obj);
+release_lats:
+	PyBuffer_Release(&lats);
+	Py_DECREF(lats_obj);
+release_gqs:
+	PyBuffer_Release(&gqs);
+	return ret;
+}
+
+static PyObject*
+geoquad_parse_many(PyObject *self, PyObject *args, PyObject *kw)
+{
+	return decode_many(args, kw, 0.0);
+}
+
+static PyObject*
+geoquad_center_many(PyObject *self, PyObject *args, PyObject *kw)
+{
+	return decode_many(args, kw, GEOQUAD_STEP / 2);
+}
+
 static PyObject*
 geoquad_contains(PyObject *self, PyObject *args)
 {
@@ -210,15 +645,15 @@ geoquad_contains(PyObject *self, PyObject *args)
 	if ((ret = PyTuple_New(2)) == NULL)
 		return NULL;
 
-	deinterleave_full((uint32_t) geoquad, &half_lat, &half_lng);
-	lat = ((half_lat * GEOQUAD_STEP) + LATITUDE_MIN);
-	lng = ((half_lng * GEOQUAD_STEP) + LONGITUDE_MIN);
+	gq_deinterleave_full((uint32_t) geoquad, &half_lat, &half_lng);
+	lat = ((half_lat * GEOQUAD_STEP) + GEOQUAD_LATITUDE_MIN);
+	lng = ((half_lng * GEOQUAD_STEP) + GEOQUAD_LONGITUDE_MIN);
 
 	return PyBool_FromLong((lat <= in_lat) && ((lat + GEOQUAD_STEP) > in_lat) && (lng <= in_lng) && ((lng + GEOQUAD_STEP) > in_lng));
 }
 
 /* Define Python functions for northof, southof, eastof, and westof from the
- * corresponding quad_Xof functions.
+ * corresponding gq_Xof functions.
  */
 #define GEOQUAD_DIROF(dir)\
 	static PyObject*\
@@ -227,26 +662,232 @@ geoquad_contains(PyObject *self, PyObject *args)
 		long geoquad;\
 		if (!PyArg_ParseTuple(args, "l", &geoquad))\
 			return NULL;\
-		return PyInt_FromLong((long) quad_##dir##of((uint32_t) geoquad));\
+		return PyInt_FromLong((long) gq_##dir##of((uint32_t) geoquad));\
 	}
 GEOQUAD_DIROF(north)
 GEOQUAD_DIROF(south)
 GEOQUAD_DIROF(east)
 GEOQUAD_DIROF(west)
 
-const static double haversine_distance(double lat1, double lng1, double lat2, double lng2)
+
+
+static void
+haversine_many_chunk(void *arg, size_t lo, size_t hi)
+{
+	batch_args *a = arg;
+
+	gq_haversine_many(a->lats + lo, a->lngs + lo, a->lats2 + lo, a->lngs2 + lo, (double *) a->out + lo, hi - lo);
+}
+
+static PyObject*
+geoquad_haversine_many(PyObject *self, PyObject *args, PyObject *kw)
+{
+	PyObject *objs[4], *out_obj = NULL, *ret = NULL;
+	Py_buffer views[4], out;
+	Py_ssize_t n = 0;
+	int i, got = 0, nogil;
+	batch_args a;
+
+	static char *kwlist[] = {"lat1", "lng1", "lat2", "lng2", "out", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "OOOO|O", kwlist, &objs[0], &objs[1], &objs[2], &objs[3], &out_obj))
+		return NULL;
+
+	for (got = 0; got < 4; got++) {
+		if (get_buffer(objs[got], &views[got], kwlist[got], "d", sizeof(double), 0) == -1)
+			goto release;
+		if (got == 0) {
+			n = views[0].len / sizeof(double);
+		} else if (views[got].len / sizeof(double) != n) {
+			PyErr_SetString(PyExc_ValueError, "lat1, lng1, lat2 and lng2 must have the same length");
+			got++;
+			goto release;
+		}
+	}
+	if (get_out_buffer(out_obj, &out_obj, &out, "out", 'd', "d", sizeof(double), n) == -1)
+		goto release;
+
+	a.lats = views[0].buf;
+	a.lngs = views[1].buf;
+	a.lats2 = views[2].buf;
+	a.lngs2 = views[3].buf;
+	a.out = out.buf;
+	nogil = view_nogil(&out);
+	for (i = 0; i < 4; i++)
+		nogil = nogil && view_nogil(&views[i]);
+	BEGIN_ALLOW_THREADS_FOR(nogil ? n : 0)
+	pool_run(haversine_many_chunk, &a, n, BATCH_GRAIN);
+	END_ALLOW_THREADS_FOR
+	ret = out_obj;
+
+	PyBuffer_Release(&out);
+release:
+	for (i = 0; i < got; i++)
+		PyBuffer_Release(&views[i]);
+	return ret;
+}
+
+
+static void
+distances_from_chunk(void *arg, size_t lo, size_t hi)
 {
-	double shlat, shlng;
+	batch_args *a = arg;
 
-	lng1 = TO_RADIANS(lng1);
-	lat1 = TO_RADIANS(lat1);
-	lng2 = TO_RADIANS(lng2);
-	lat2 = TO_RADIANS(lat2);
+	gq_distances_from(a->lat, a->lng, a->lats + lo, a->lngs + lo, (double *) a->out + lo, hi - lo);
+}
+
+static PyObject*
+geoquad_distances_from(PyObject *self, PyObject *args, PyObject *kw)
+{
+	PyObject *lats_obj, *lngs_obj, *out_obj = NULL, *ret = NULL;
+	Py_buffer lats, lngs, out;
+	double lat, lng;
+	Py_ssize_t n;
+	batch_args a;
+
+	static char *kwlist[] = {"origin", "lats", "lngs", "out", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "(dd)OO|O", kwlist, &lat, &lng, &lats_obj, &lngs_obj, &out_obj))
+		return NULL;
+
+	if (get_buffer(lats_obj, &lats, "lats", "d", sizeof(double), 0) == -1)
+		return NULL;
+	if (get_buffer(lngs_obj, &lngs, "lngs", "d", sizeof(double), 0) == -1)
+		goto release_lats;
+
+	n = lats.len / sizeof(double);
+	if (lngs.len / sizeof(double) != n) {
+		PyErr_SetString(PyExc_ValueError, "lats and lngs must have the same length");
+		goto release_lngs;
+	}
+	if (get_out_buffer(out_obj, &out_obj, &out, "out", 'd', "d", sizeof(double), n) == -1)
+		goto release_lngs;
+
+	a.lat = lat;
+	a.lng = lng;
+	a.lats = lats.buf;
+	a.lngs = lngs.buf;
+	a.out = out.buf;
+	BEGIN_ALLOW_THREADS_FOR((view_nogil(&lats) && view_nogil(&lngs) && view_nogil(&out)) ? n : 0)
+	pool_run(distances_from_chunk, &a, n, BATCH_GRAIN);
+	END_ALLOW_THREADS_FOR
+	ret = out_obj;
+
+	PyBuffer_Release(&out);
+release_lngs:
+	PyBuffer_Release(&lngs);
+release_lats:
+	PyBuffer_Release(&lats);
+	return ret;
+}
+
+
+static void
+within_radius_chunk(void *arg, size_t lo, size_t hi)
+{
+	batch_args *a = arg;
+	size_t count;
+
+	count = gq_within_radius(a->lat, a->lng, a->radius, a->lats + lo, a->lngs + lo, (uint8_t *) a->out + lo, hi - lo);
+	__sync_fetch_and_add(&a->count, count);
+}
+
+static PyObject*
+geoquad_within_radius(PyObject *self, PyObject *args, PyObject *kw)
+{
+	PyObject *lats_obj, *lngs_obj, *mask, *ret = NULL;
+	Py_buffer lats, lngs, out;
+	double lat, lng, radius;
+	Py_ssize_t i, j, n, count;
+	uint8_t *m;
+	unsigned long *idx;
+	int indices = 0;
+	batch_args a;
+
+	static char *kwlist[] = {"origin", "radius", "lats", "lngs", "indices", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "(dd)dOO|i", kwlist, &lat, &lng, &radius, &lats_obj, &lngs_obj, &indices))
+		return NULL;
+
+	if (get_buffer(lats_obj, &lats, "lats", "d", sizeof(double), 0) == -1)
+		return NULL;
+	if (get_buffer(lngs_obj, &lngs, "lngs", "d", sizeof(double), 0) == -1)
+		goto release_lats;
+
+	n = lats.len / sizeof(double);
+	if (lngs.len / sizeof(double) != n) {
+		PyErr_SetString(PyExc_ValueError, "lats and lngs must have the same length");
+		goto release_lngs;
+	}
+	if (!(mask = PyByteArray_FromStringAndSize(NULL, n)))
+		goto release_lngs;
+
+	m = (uint8_t *) PyByteArray_AS_STRING(mask);
+	a.lat = lat;
+	a.lng = lng;
+	a.radius = radius;
+	a.lats = lats.buf;
+	a.lngs = lngs.buf;
+	a.out = m;
+	a.count = 0;
+	BEGIN_ALLOW_THREADS_FOR((view_nogil(&lats) && view_nogil(&lngs)) ? n : 0)
+	pool_run(within_radius_chunk, &a, n, BATCH_GRAIN);
+	END_ALLOW_THREADS_FOR
+	count = a.count;
+	if (!indices) {
+		ret = mask;
+		goto release_lngs;
+	}
 
-	shlat = sin((lat2 - lat1) / 2.0);
-	shlng = sin((lng2 - lng1) / 2.0);
+	/* Convert the mask to an array of indices */
+	if (!(ret = new_array('L', count)))
+		goto release_mask;
+	if (get_buffer(ret, &out, "indices", "L", sizeof(unsigned long), 1) == -1) {
+		Py_CLEAR(ret);
+		goto release_mask;
+	}
+	idx = out.buf;
+	for (i = 0, j = 0; i < n; i++) {
+		if (m[i])
+			idx[j++] = i;
+	}
+	PyBuffer_Release(&out);
+
+release_mask:
+	Py_DECREF(mask);
+release_lngs:
+	PyBuffer_Release(&lngs);
+release_lats:
+	PyBuffer_Release(&lats);
+	return ret;
+}
+
+/* Names of the GEOQUAD_SIMD_* levels */
+static const char *simd_names[] = {"scalar", "avx2", "avx512"};
+
+static PyObject*
+geoquad_set_simd(PyObject *self, PyObject *args)
+{
+	const char *name;
+	int level, prev = gq_use_simd;
+
+	if (!PyArg_ParseTuple(args, "s", &name))
+		return NULL;
 
-	return EARTH_RADIUS_MI * 2.0 * asin(fmin(1.0, sqrt(shlat * shlat + cos(lat1) * cos(lat2) * shlng * shlng)));
+	for (level = GEOQUAD_SIMD_SCALAR; level <= GEOQUAD_SIMD_AVX512; level++) {
+		if (!strcmp(name, simd_names[level]))
+			break;
+	}
+	if (level > GEOQUAD_SIMD_AVX512) {
+		PyErr_Format(PyExc_ValueError, "Unknown SIMD level '%s'", name);
+		return NULL;
+	}
+	if (level > gq_have_simd) {
+		PyErr_Format(PyExc_ValueError, "SIMD level '%s' is not supported by this CPU", name);
+		return NULL;
+	}
+	gq_use_simd = level;
+	return PyString_FromString(simd_names[prev]);
 }
 
 static PyObject*
@@ -272,9 +913,10 @@ geoquad_haversine_distance(PyObject *self, PyObject *args)
 	lat2 = PyFloat_AsDouble(PyTuple_GET_ITEM(t2, 0));
 	lng2 = PyFloat_AsDouble(PyTuple_GET_ITEM(t2, 1));
 
-	return PyFloat_FromDouble(haversine_distance(lat1, lng1, lat2, lng2));
+	return PyFloat_FromDouble(gq_haversine_distance(lat1, lng1, lat2, lng2));
 }
 
+
 /* This creates a Python list object containing a list of geoquads. The
  * interpretation of the return result and of the arguments is as follows:
  *
@@ -289,203 +931,3217 @@ geoquad_haversine_distance(PyObject *self, PyObject *args)
  * of @halves;
  *
  * This function goes through and creates a Python list object containing all
- * of the geoquads in the circle by using the fast quad_southof function.
+ * of the geoquads in the circle by using the fast gq_southof function.
  */
 static PyObject*
 fill_nearby_list(uint16_t halves[], uint16_t lng_w, size_t len)
 {
 	int i;
+	Py_ssize_t j = 0;
 	uint16_t t, b;
 	uint32_t q;
 	uint16_t lng;
 	PyObject *g, *gs;
-	gs = PyList_New(0); /* FIXME */
+
+	if (!(gs = PyList_New(gq_nearby_total(halves, len))))
+		return NULL;
 
 	lng = lng_w;
 	for (i = 0; i < len; i++) {
 		t = halves[i];
 		b = halves[len + i];
 
-		q = interleave_full(lng, t);
+		q = gq_interleave_full(lng, t);
 
-		/* Append the top geoquad to the list. */
+		/* Add the top geoquad to the list. */
 		if (!(g = PyInt_FromLong((long) q)))
-			return NULL;
-		if (PyList_Append(gs, g))
-			return NULL;
+			goto error;
+		PyList_SET_ITEM(gs, j++, g);
 
 		while (t > b) {
 
 			/* This computes the geoquad south of q */
-			q &= INTER32L;
+			q &= GEOQUAD_INTER32L;
 			t--;
-			q |= (interleave_half(t) << 1);
+			q |= (gq_interleave_half(t) << 1);
 
 			/* Add the geoquad to our list */
 			if (!(g = PyInt_FromLong((long) q)))
-				return NULL;
-			if (PyList_Append(gs, g))
-				return NULL;
+				goto error;
+			PyList_SET_ITEM(gs, j++, g);
 		}
 
 		/* Move one quad east */
 		lng++;
 	}
 	return gs;
+
+error:
+	Py_DECREF(gs);
+	return NULL;
+}
+
+
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* Sets the exception for an error returned by gq_nearby_halves, or for
+ * running out of memory otherwise */
+static PyObject*
+nearby_error(int err)
+{
+	if (err == GEOQUAD_BAD_RADIUS)
+		PyErr_SetString(PyExc_ValueError, "radius must be finite");
+	else
+		PyErr_NoMemory();
+	return NULL;
 }
 
 static PyObject*
 geoquad_nearby(PyObject *self, PyObject *args, PyObject *kw)
 {
 	long geoquad;
-	double radius, radius_lat;
-	double f_lng_orig, f_lat_orig, f_lng, f_lat;
-	uint16_t lng_w, lng_e;
-	uint16_t lng, lat, lng_orig, lat_orig;
-	size_t i, count;
-	int fuzz = 0;
-	PyObject *ret;
+	double radius;
+	uint16_t lng_w;
+	size_t count, total;
+	int fuzz = 0, err;
+	PyObject *ret, *out_obj = NULL;
+	Py_buffer out;
 	uint16_t *halves;
 
-	static char *kwlist[] = {"geoquad", "radius", "fuzz", NULL};
+	static char *kwlist[] = {"geoquad", "radius", "fuzz", "out", NULL};
 
-	if (!PyArg_ParseTupleAndKeywords(args, kw, "ld|i", kwlist, &geoquad, &radius, &fuzz))
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "ld|iO", kwlist, &geoquad, &radius, &fuzz, &out_obj))
 		return NULL;
 
-	radius_lat = radius / MILES_PER_LATITUDE;
-
-	/* If the fuzz parameter evaluates to True, then the radius is
-	 * automatically "fuzzed" by making it incrementally bigger. It will be
-	 * fuzzed by the right amount so that any edge effects on the circle will
-	 * be handled correctly.
-	 */
-	if (fuzz)
-		radius_lat += GEOQUAD_FUZZ;
-
-	/* Parse the geoquad into a lng, lat and compute the easternmost
-	 * encompassing geoquad.
-	 *
-	 * FIXME: we might be off by one w/o the lat/lng conversion, is there a
-	 * way to fix that? Skipping it would be faster. */
-
-	deinterleave_full((uint32_t) geoquad, &lng, &lat);
-	lat_orig = lat;
-	lng_orig = lng;
-
-	f_lng_orig = half_to_lng(lng);
-	f_lat_orig = half_to_lat(lat);
-
-	/* Get the westernmost geoquad. This is an overestimate since it's only
-	 * valid at the equator. At latitudes closer to the poles longitudes may
-	 * be closer together, meaning we'll have to adjust this a bit.
-	 *
-	 * This estimates the "widest" part, horizontally, of the circle at the
-	 * center. This may not actually be true for very large circles close to
-	 * the poles (and almost certainly isn't true when the circle contains a
-	 * pole). We don't expect that to happen in normal usage, however.*/
-	lng_w = lng - (uint16_t) ceil(radius_lat / GEOQUAD_STEP);
-	f_lng = half_to_lng(lng_w);
-	while (haversine_distance(f_lat_orig, f_lng + GEOQUAD_STEP, f_lat_orig, f_lng_orig) > radius) {
-		lng_w++;
-		f_lng = half_to_lng(lng_w);
-	}
-
-	/* Get the easternmost quad. This is an overestimate, same note as above
-	 * really. */
-	lng_e = lng + (uint16_t) floor(radius_lat / GEOQUAD_STEP);
-	f_lng = half_to_lng(lng_e);
-	while (haversine_distance(f_lat_orig, f_lng, f_lat_orig, f_lng_orig) > radius) {
-		lng_e--;
-		f_lng = half_to_lng(lng_e);
-	}
-
-	count = lng_e - lng_w + 1;
-
-	halves = PyMem_Malloc(sizeof(uint16_t) * (count << 1));
-	if (halves == NULL)
-		return PyErr_NoMemory();
+	Py_BEGIN_ALLOW_THREADS
+	err = gq_nearby_halves((uint32_t) geoquad, radius, fuzz, &halves, &lng_w, &count);
+	Py_END_ALLOW_THREADS
+	if (err < 0)
+		return nearby_error(err);
 
-	i = 0;
-	for (lng = lng_w; lng <= lng_e; lng++) {
-		lat = lat_orig;
-		f_lng = half_to_lng(lng);
-		f_lat = half_to_lat(lat);
-
-		/* If on the west side of the ricle, use the east edge of each geoquad */
-		if (f_lng <= f_lng_orig) {
-			while (haversine_distance(f_lat, f_lng + GEOQUAD_STEP, f_lat_orig, f_lng_orig) <= radius) {
-				lat++;
-				f_lat = half_to_lat(lat);
-			}
-			lat--;
-			halves[i] = lat;
-
-			lat = lat_orig;
-			f_lat = half_to_lat(lat);
-			while (haversine_distance(f_lat + GEOQUAD_STEP, f_lng + GEOQUAD_STEP, f_lat_orig, f_lng_orig) <= radius) {
-				lat--;
-				f_lat = half_to_lat(lat);
-			}
-			lat++;
-			halves[i + count] = lat;
-		} else if (f_lng > f_lng_orig) {
-			while (haversine_distance(f_lat, f_lng, f_lat_orig, f_lng_orig) <= radius) {
-				lat++;
-				f_lat = half_to_lat(lat);
-			}
-			lat--;
-			halves[i] = lat;
-
-			lat = lat_orig;
-			f_lat = half_to_lat(lat);
-			while (haversine_distance(f_lat + GEOQUAD_STEP, f_lng, f_lat_orig, f_lng_orig) <= radius) {
-				lat--;
-				f_lat = half_to_lat(lat);
-			}
-			lat++;
-			halves[i + count] = lat;
+	/* With an output buffer the geoquads are written straight into it and
+	 * the number written is returned; nearby_count gives the size needed. */
+	if ((out_obj != NULL) && (out_obj != Py_None)) {
+		total = gq_nearby_total(halves, count);
+		if (get_out_buffer(out_obj, &out_obj, &out, "out", 'I', "IL", sizeof(uint32_t), total) == -1) {
+			free(halves);
+			return NULL;
 		}
-		i++;
+		BEGIN_ALLOW_THREADS_FOR(view_nogil(&out) ? total : 0)
+		gq_nearby_fill(halves, lng_w, count, out.buf);
+#ifdef DEBUG
+		qsort(out.buf, total, sizeof(uint32_t), compare_uint32);
+#endif
+		END_ALLOW_THREADS_FOR
+		free(halves);
+		PyBuffer_Release(&out);
+		Py_DECREF(out_obj);
+		return PyInt_FromSize_t(total);
 	}
 
 	ret = fill_nearby_list(halves, lng_w, count);
-	PyMem_Free(halves);
+	free(halves);
 
 #ifdef DEBUG
-	if (PyList_Sort(ret) == -1)
+	if (ret && (PyList_Sort(ret) == -1)) {
+		Py_DECREF(ret);
 		return NULL;
+	}
 #endif
 
 	return ret;
 }
 
-static PyMethodDef geoquad_methods[] = {
-	{ "create", (PyCFunction) geoquad_create, METH_VARARGS, "create a geoquad from a (lat, lng)" },
-	{ "parse", (PyCFunction) geoquad_parse, METH_VARARGS, "SW corner of a geoquad, returns a (lat, lng)" },
-	{ "center", (PyCFunction) geoquad_center, METH_VARARGS, "center of a geoquad, returns a (lat, lng)" },
-	{ "contains", (PyCFunction) geoquad_contains, METH_VARARGS, "whether or not a geoquad contaings a lng, lat" },
-	{ "northof", (PyCFunction) geoquad_northof, METH_VARARGS, "returns the geoquad directly north of a given geoquad" },
-	{ "southof", (PyCFunction) geoquad_southof, METH_VARARGS, "returns the geoquad directly south of a given geoquad" },
-	{ "eastof", (PyCFunction) geoquad_eastof, METH_VARARGS, "returns the geoquad directly east of a given geoquad" },
-	{ "westof", (PyCFunction) geoquad_westof, METH_VARARGS, "returns the geoquad directly west of a given geoquad" },
-	{ "nearby", (PyCFunction) geoquad_nearby, METH_VARARGS|METH_KEYWORDS, "get nearby geoquads, returns a list of geoquads" },
-	{ "haversine_distance", (PyCFunction) geoquad_haversine_distance, METH_VARARGS, "haversine distance beteween two (lat, lng) tuples" },
-	{ NULL }
+static PyObject*
+geoquad_nearby_count(PyObject *self, PyObject *args, PyObject *kw)
+{
+	long geoquad;
+	double radius;
+	uint16_t lng_w;
+	size_t count, total = 0;
+	int fuzz = 0, err;
+	uint16_t *halves;
+
+	static char *kwlist[] = {"geoquad", "radius", "fuzz", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "ld|i", kwlist, &geoquad, &radius, &fuzz))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	if (!(err = gq_nearby_halves((uint32_t) geoquad, radius, fuzz, &halves, &lng_w, &count))) {
+		total = gq_nearby_total(halves, count);
+		free(halves);
+	}
+	Py_END_ALLOW_THREADS
+	if (err < 0)
+		return nearby_error(err);
+	return PyInt_FromSize_t(total);
+}
+
+/* A lazy version of nearby. The halves array is computed up front (that's
+ * cheap, it's one entry per column) but the geoquads are only produced as the
+ * iterator is advanced, in the same order as fill_nearby_list.
+ */
+typedef struct {
+	PyObject_HEAD
+	uint16_t *halves;
+	size_t count;     /* number of columns */
+	size_t col;       /* current column */
+	uint16_t lng_w;   /* westernmost column */
+	uint16_t lat;     /* last latitude produced in the current column */
+	int in_col;       /* whether the current column's top was produced */
+} NearbyIterObject;
+
+static void
+nearby_iter_dealloc(NearbyIterObject *it)
+{
+	free(it->halves);
+	PyObject_Del(it);
+}
+
+static PyObject*
+nearby_iter_next(NearbyIterObject *it)
+{
+	while (it->col < it->count) {
+		if (!it->in_col) {
+			it->lat = it->halves[it->col];
+			it->in_col = 1;
+			return PyInt_FromLong((long) gq_interleave_full(it->lng_w + it->col, it->lat));
+		}
+		if (it->lat > it->halves[it->count + it->col]) {
+			it->lat--;
+			return PyInt_FromLong((long) gq_interleave_full(it->lng_w + it->col, it->lat));
+		}
+		it->col++;
+		it->in_col = 0;
+	}
+	return NULL;
+}
+
+static PyTypeObject NearbyIterType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"geoquad.NearbyIterator",          /* tp_name */
+	sizeof(NearbyIterObject),          /* tp_basicsize */
+	0,                                 /* tp_itemsize */
+	(destructor) nearby_iter_dealloc,  /* tp_dealloc */
+	0,                                 /* tp_print */
+	0,                                 /* tp_getattr */
+	0,                                 /* tp_setattr */
+	0,                                 /* tp_compare */
+	0,                                 /* tp_repr */
+	0,                                 /* tp_as_number */
+	0,                                 /* tp_as_sequence */
+	0,                                 /* tp_as_mapping */
+	0,                                 /* tp_hash */
+	0,                                 /* tp_call */
+	0,                                 /* tp_str */
+	0,                                 /* tp_getattro */
+	0,                                 /* tp_setattro */
+	0,                                 /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,                /* tp_flags */
+	"iterator over nearby geoquads",   /* tp_doc */
+	0,                                 /* tp_traverse */
+	0,                                 /* tp_clear */
+	0,                                 /* tp_richcompare */
+	0,                                 /* tp_weaklistoffset */
+	PyObject_SelfIter,                 /* tp_iter */
+	(iternextfunc) nearby_iter_next,   /* tp_iternext */
 };
 
-PyMODINIT_FUNC initgeoquad(void)
+static PyObject*
+geoquad_iter_nearby(PyObject *self, PyObject *args, PyObject *kw)
 {
-	PyObject *m = Py_InitModule3("geoquad", geoquad_methods, "test");
+	long geoquad;
+	double radius;
+	int fuzz = 0, err;
+	NearbyIterObject *it;
+
+	static char *kwlist[] = {"geoquad", "radius", "fuzz", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "ld|i", kwlist, &geoquad, &radius, &fuzz))
+		return NULL;
+
+	if (!(it = PyObject_New(NearbyIterObject, &NearbyIterType)))
+		return NULL;
+	it->col = 0;
+	it->in_col = 0;
+	Py_BEGIN_ALLOW_THREADS
+	err = gq_nearby_halves((uint32_t) geoquad, radius, fuzz, &it->halves, &it->lng_w, &it->count);
+	Py_END_ALLOW_THREADS
+	if (err < 0) {
+		it->halves = NULL;
+		Py_DECREF(it);
+		return nearby_error(err);
+	}
+	return (PyObject *) it;
+}
+
+/* Sorts @n geoquads in place. Small arrays use qsort, larger ones an LSD
+ * radix sort on bytes, skipping the passes where every key has the same
+ * byte. Returns -1 if out of memory.
+ */
+static int
+sort_uint32(uint32_t *keys, size_t n)
+{
+	size_t counts[4][256], i, sum, c;
+	uint32_t *tmp, *src, *dst, *swap;
+	int pass, b;
+
+	if (n < 256) {
+		qsort(keys, n, sizeof(uint32_t), compare_uint32);
+		return 0;
+	}
+	if (!(tmp = malloc(sizeof(uint32_t) * n)))
+		return -1;
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < n; i++) {
+		for (pass = 0; pass < 4; pass++)
+			counts[pass][(keys[i] >> (pass * 8)) & 0xFF]++;
+	}
+
+	src = keys;
+	dst = tmp;
+	for (pass = 0; pass < 4; pass++) {
+		if (counts[pass][(keys[0] >> (pass * 8)) & 0xFF] == n)
+			continue;
+		for (b = 0, sum = 0; b < 256; b++) {
+			c = counts[pass][b];
+			counts[pass][b] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			dst[counts[pass][(src[i] >> (pass * 8)) & 0xFF]++] = src[i];
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != keys)
+		memcpy(keys, src, sizeof(uint32_t) * n);
+	free(tmp);
+	return 0;
+}
+
+/* Removes duplicates from the sorted array @keys, returns the new length */
+static size_t
+unique_uint32(uint32_t *keys, size_t n)
+{
+	size_t i, j;
+
+	if (n == 0)
+		return 0;
+	for (i = 1, j = 0; i < n; i++) {
+		if (keys[i] != keys[j])
+			keys[++j] = keys[i];
+	}
+	return j + 1;
+}
+
+/* Builds a list of (lo, hi) tuples from @m ranges */
+static PyObject*
+ranges_to_list(const uint32_t *ranges, size_t m)
+{
+	PyObject *ret, *r;
+	size_t i;
+
+	if (!(ret = PyList_New(m)))
+		return NULL;
+	for (i = 0; i < m; i++) {
+		if (!(r = Py_BuildValue("(ll)", (long) ranges[2 * i], (long) ranges[2 * i + 1]))) {
+			Py_DECREF(ret);
+			return NULL;
+		}
+		PyList_SET_ITEM(ret, i, r);
+	}
+	return ret;
+}
+
+/* Coalesces the sorted geoquads in @quads into inclusive ranges of
+ * consecutive Morton codes, stored as lo, hi pairs in @ranges (which needs
+ * room for 2 * n values). Returns the number of ranges.
+ */
+static size_t
+quads_to_ranges(const uint32_t *quads, size_t n, uint32_t *ranges)
+{
+	size_t i, m = 0;
+
+	for (i = 0; i < n; i++) {
+		if (m && (quads[i] - ranges[2 * m - 1] <= 1)) {
+			ranges[2 * m - 1] = quads[i];
+		} else {
+			ranges[2 * m] = ranges[2 * m + 1] = quads[i];
+			m++;
+		}
+	}
+	return m;
+}
+
+/* Merges the @m ranges in @ranges down to at most @max_ranges by closing the
+ * smallest gaps between them, which keeps the number of extra geoquads
+ * covered as small as possible. Returns the new number of ranges, or -1 if
+ * out of memory.
+ */
+static Py_ssize_t
+merge_ranges(uint32_t *ranges, size_t m, size_t max_ranges)
+{
+	uint32_t *gaps, threshold;
+	size_t i, j, close, closed_at_threshold, below;
+
+	if ((max_ranges == 0) || (m <= max_ranges))
+		return m;
+
+	if (!(gaps = malloc(sizeof(uint32_t) * (m - 1))))
+		return -1;
+	for (i = 0; i < m - 1; i++)
+		gaps[i] = ranges[2 * i + 2] - ranges[2 * i + 1];
+	qsort(gaps, m - 1, sizeof(uint32_t), compare_uint32);
+
+	/* Every gap smaller than the threshold is closed, and just enough of the
+	 * gaps equal to it to get down to max_ranges. */
+	close = m - max_ranges;
+	threshold = gaps[close - 1];
+	for (below = 0; (below < close) && (gaps[below] < threshold); below++)
+		;
+	closed_at_threshold = close - below;
+	free(gaps);
+
+	for (i = 1, j = 0; i < m; i++) {
+		uint32_t gap = ranges[2 * i] - ranges[2 * j + 1];
+		if ((gap < threshold) || ((gap == threshold) && closed_at_threshold && closed_at_threshold--)) {
+			ranges[2 * j + 1] = ranges[2 * i + 1];
+		} else {
+			j++;
+			ranges[2 * j] = ranges[2 * i];
+			ranges[2 * j + 1] = ranges[2 * i + 1];
+		}
+	}
+	return j + 1;
+}
+
+static PyObject*
+geoquad_nearby_ranges(PyObject *self, PyObject *args, PyObject *kw)
+{
+	long geoquad;
+	double radius;
+	uint16_t lng_w, *halves = NULL;
+	size_t count, total;
+	Py_ssize_t m = -1, max_ranges = 0;
+	int fuzz = 0, err;
+	uint32_t *quads = NULL, *ranges = NULL;
+	PyObject *ret = NULL;
+
+	static char *kwlist[] = {"geoquad", "radius", "fuzz", "max_ranges", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "ld|in", kwlist, &geoquad, &radius, &fuzz, &max_ranges))
+		return NULL;
+	if (max_ranges < 0) {
+		PyErr_SetString(PyExc_ValueError, "max_ranges must not be negative");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	if ((err = gq_nearby_halves((uint32_t) geoquad, radius, fuzz, &halves, &lng_w, &count)) < 0)
+		goto computed;
+	total = gq_nearby_total(halves, count);
+	quads = malloc(sizeof(uint32_t) * (total + 1));
+	ranges = malloc(sizeof(uint32_t) * 2 * (total + 1));
+	if (!quads || !ranges)
+		goto computed;
+
+	gq_nearby_fill(halves, lng_w, count, quads);
+	if (sort_uint32(quads, total) == -1)
+		goto computed;
+	m = quads_to_ranges(quads, total, ranges);
+	m = merge_ranges(ranges, m, max_ranges);
+computed:
+	Py_END_ALLOW_THREADS
+
+	if (m == -1)
+		nearby_error(err);
+	else
+		ret = ranges_to_list(ranges, m);
+
+	free(halves);
+	free(quads);
+	free(ranges);
+	return ret;
+}
+
+/* The nearby cover of one origin, as computed by gq_nearby_halves */
+typedef struct {
+	uint16_t *halves;   /* NULL on error */
+	int err;            /* from gq_nearby_halves */
+	size_t count;
+	uint16_t lng_w;
+	size_t total;
+	size_t start;       /* of its geoquads in the output */
+} nearby_cover;
+
+/* Origins are split across the thread pool in chunks of this many */
+#define NEARBY_GRAIN  16
+
+typedef struct {
+	const uint32_t *gqs;
+	double radius;
+	int fuzz;
+	nearby_cover *covers;
+	uint32_t *out;
+} nearby_many_args;
+
+static void
+nearby_covers_chunk(void *arg, size_t lo, size_t hi)
+{
+	nearby_many_args *a = arg;
+	nearby_cover *c;
+	size_t i;
+
+	for (i = lo; i < hi; i++) {
+		c = &a->covers[i];
+		if ((c->err = gq_nearby_halves(a->gqs[i], a->radius, a->fuzz, &c->halves, &c->lng_w, &c->count)) < 0)
+			c->halves = NULL;
+		else
+			c->total = gq_nearby_total(c->halves, c->count);
+	}
+}
+
+static void
+nearby_fill_chunk(void *arg, size_t lo, size_t hi)
+{
+	nearby_many_args *a = arg;
+	nearby_cover *c;
+	size_t i;
+
+	for (i = lo; i < hi; i++) {
+		c = &a->covers[i];
+		gq_nearby_fill(c->halves, c->lng_w, c->count, a->out + c->start);
+#ifdef DEBUG
+		qsort(a->out + c->start, c->total, sizeof(uint32_t), compare_uint32);
+#endif
+	}
+}
+
+static PyObject*
+geoquad_nearby_many(PyObject *self, PyObject *args, PyObject *kw)
+{
+	PyObject *gqs_obj, *quads_obj = NULL, *offsets_obj = NULL, *ret = NULL;
+	Py_buffer gqs, quads_view, offsets_view;
+	const char *mode = "union";
+	double radius;
+	int fuzz = 0, per_origin = 0, as_ranges = 0;
+	Py_ssize_t max_ranges = 0, m = -1;
+	size_t i, n, total = 0;
+	nearby_cover *covers = NULL;
+	nearby_many_args a;
+	uint32_t *quads = NULL, *ranges = NULL;
+	unsigned long *offsets;
+
+	static char *kwlist[] = {"geoquads", "radius", "fuzz", "mode", "max_ranges", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "Od|isn", kwlist, &gqs_obj, &radius, &fuzz, &mode, &max_ranges))
+		return NULL;
+	if (!strcmp(mode, "per_origin")) {
+		per_origin = 1;
+	} else if (!strcmp(mode, "ranges")) {
+		as_ranges = 1;
+	} else if (strcmp(mode, "union")) {
+		PyErr_Format(PyExc_ValueError, "Unknown mode '%s'; should be 'union', 'per_origin' or 'ranges'", mode);
+		return NULL;
+	}
+	if (max_ranges < 0) {
+		PyErr_SetString(PyExc_ValueError, "max_ranges must not be negative");
+		return NULL;
+	}
+
+	if (get_buffer(gqs_obj, &gqs, "geoquads", "IL", sizeof(uint32_t), 0) == -1)
+		return NULL;
+	n = gqs.len / sizeof(uint32_t);
+
+	/* Compute every cover first so the output can be sized exactly */
+	if (!(covers = calloc(n + 1, sizeof(nearby_cover)))) {
+		PyErr_NoMemory();
+		goto release;
+	}
+	a.gqs = gqs.buf;
+	a.radius = radius;
+	a.fuzz = fuzz;
+	a.covers = covers;
+	BEGIN_ALLOW_THREADS_IF(view_nogil(&gqs))
+	pool_run(nearby_covers_chunk, &a, n, NEARBY_GRAIN);
+	END_ALLOW_THREADS_FOR
+	for (i = 0; i < n; i++) {
+		if (!covers[i].halves) {
+			nearby_error(covers[i].err);
+			goto release;
+		}
+		covers[i].start = total;
+		total += covers[i].total;
+	}
+
+	if (per_origin) {
+		if (!(quads_obj = new_array('I', total)) || !(offsets_obj = new_array('L', n + 1)))
+			goto release;
+		if (get_buffer(quads_obj, &quads_view, "quads", "I", sizeof(uint32_t), 1) == -1)
+			goto release;
+		if (get_buffer(offsets_obj, &offsets_view, "offsets", "L", sizeof(unsigned long), 1) == -1) {
+			PyBuffer_Release(&quads_view);
+			goto release;
+		}
+		offsets = offsets_view.buf;
+		for (i = 0; i < n; i++)
+			offsets[i] = covers[i].start;
+		offsets[n] = total;
+		a.out = quads_view.buf;
+		BEGIN_ALLOW_THREADS_FOR(total)
+		pool_run(nearby_fill_chunk, &a, n, NEARBY_GRAIN);
+		END_ALLOW_THREADS_FOR
+		PyBuffer_Release(&quads_view);
+		PyBuffer_Release(&offsets_view);
+		ret = PyTuple_Pack(2, quads_obj, offsets_obj);
+		goto release;
+	}
+
+	/* Union: gather everything, sort and drop the duplicates */
+	Py_BEGIN_ALLOW_THREADS
+	if (!(quads = malloc(sizeof(uint32_t) * (total + 1))))
+		goto gathered;
+	a.out = quads;
+	pool_run(nearby_fill_chunk, &a, n, NEARBY_GRAIN);
+	if (sort_uint32(quads, total) == -1)
+		goto gathered;
+	total = unique_uint32(quads, total);
+	if (as_ranges) {
+		if (!(ranges = malloc(sizeof(uint32_t) * 2 * (total + 1))))
+			goto gathered;
+		m = quads_to_ranges(quads, total, ranges);
+		m = merge_ranges(ranges, m, max_ranges);
+	} else {
+		m = 0;
+	}
+gathered:
+	Py_END_ALLOW_THREADS
+	if (m == -1) {
+		PyErr_NoMemory();
+		goto release;
+	}
+
+	if (as_ranges) {
+		ret = ranges_to_list(ranges, m);
+		goto release;
+	}
+
+	if (!(quads_obj = new_array('I', total)))
+		goto release;
+	if (get_buffer(quads_obj, &quads_view, "quads", "I", sizeof(uint32_t), 1) == -1)
+		goto release;
+	memcpy(quads_view.buf, quads, sizeof(uint32_t) * total);
+	PyBuffer_Release(&quads_view);
+	ret = quads_obj;
+	quads_obj = NULL;
+
+release:
+	if (covers) {
+		for (i = 0; i < n; i++)
+			free(covers[i].halves);
+		free(covers);
+	}
+	free(quads);
+	free(ranges);
+	Py_XDECREF(quads_obj);
+	Py_XDECREF(offsets_obj);
+	PyBuffer_Release(&gqs);
+	return ret;
+}
+
+/***************************
+ * NEARBY DIFFERENCES
+ *
+ * Two nearby covers differ column by column in at most two runs of geoquads,
+ * so the difference of two covers can be written out directly from their
+ * halves arrays instead of enumerating both and subtracting sets.
+ **************************/
+
+/* The rows [@lo, @hi] of column @i of a halves array. A column always holds
+ * at least its top geoquad (see gq_nearby_total). */
+static inline void
+column_span(const uint16_t halves[], size_t len, size_t i, int *lo, int *hi)
+{
+	*hi = halves[i];
+	*lo = (halves[len + i] < halves[i]) ? halves[len + i] : halves[i];
+}
+
+/* Writes the geoquads of cover @a that aren't in cover @b to @out, which must
+ * have room for gq_nearby_total(a, a_len) of them, and returns how many were
+ * written. Each column is written from the top down, like gq_nearby_fill. */
+static size_t
+cover_difference(const uint16_t a[], uint16_t a_lng_w, size_t a_len, const uint16_t b[], uint16_t b_lng_w, size_t b_len, uint32_t *out)
+{
+	size_t i, n = 0;
+	int j, t, lo, hi, b_lo, b_hi;
+	uint16_t lng;
+
+	for (i = 0; i < a_len; i++) {
+		lng = a_lng_w + i;
+		column_span(a, a_len, i, &lo, &hi);
+
+		/* An empty span if @b has no such column */
+		b_lo = 1;
+		b_hi = 0;
+		j = (int) lng - (int) b_lng_w;
+		if ((j >= 0) && ((size_t) j < b_len))
+			column_span(b, b_len, j, &b_lo, &b_hi);
+
+		for (t = hi; t >= lo; t--) {
+			if ((t <= b_hi) && (t >= b_lo)) {
+				t = b_lo;
+				continue;
+			}
+			out[n++] = gq_interleave_full(lng, (uint16_t) t);
+		}
+	}
+	return n;
+}
+
+/* Builds a list from @n geoquads, sorted if DEBUG is defined like nearby's */
+static PyObject*
+quads_to_list(uint32_t *quads, size_t n)
+{
+	PyObject *ret, *g;
+	size_t i;
+
+#ifdef DEBUG
+	qsort(quads, n, sizeof(uint32_t), compare_uint32);
+#endif
+	if (!(ret = PyList_New(n)))
+		return NULL;
+	for (i = 0; i < n; i++) {
+		if (!(g = PyInt_FromLong((long) quads[i]))) {
+			Py_DECREF(ret);
+			return NULL;
+		}
+		PyList_SET_ITEM(ret, i, g);
+	}
+	return ret;
+}
+
+/* Whether the initial bearing from the center of @origin to the center of @q
+ * is within @width degrees clockwise of @start (degrees clockwise from north).
+ * The origin itself is in every sector. */
+static int
+in_sector(uint32_t q, uint32_t origin, double start, double width)
+{
+	uint16_t half_lat, half_lng;
+	double lat0, lng0, lat, dlng, bearing;
+
+	if (q == origin)
+		return 1;
+	gq_deinterleave_full(origin, &half_lat, &half_lng);
+	lat0 = (half_lat * GEOQUAD_STEP) + GEOQUAD_LATITUDE_MIN + GEOQUAD_STEP / 2;
+	lng0 = (half_lng * GEOQUAD_STEP) + GEOQUAD_LONGITUDE_MIN + GEOQUAD_STEP / 2;
+	gq_deinterleave_full(q, &half_lat, &half_lng);
+	lat = (half_lat * GEOQUAD_STEP) + GEOQUAD_LATITUDE_MIN + GEOQUAD_STEP / 2;
+	dlng = (half_lng * GEOQUAD_STEP) + GEOQUAD_LONGITUDE_MIN + GEOQUAD_STEP / 2 - lng0;
+
+	lat0 = TO_RADIANS(lat0);
+	lat = TO_RADIANS(lat);
+	dlng = TO_RADIANS(dlng);
+	bearing = atan2(sin(dlng) * cos(lat), cos(lat0) * sin(lat) - sin(lat0) * cos(lat) * cos(dlng)) * 180.0 / M_PI;
+	bearing = fmod(bearing - start, 360.0);
+	if (bearing < 0)
+		bearing += 360.0;
+	return bearing <= width;
+}
+
+static PyObject*
+geoquad_nearby_annulus(PyObject *self, PyObject *args, PyObject *kw)
+{
+	long geoquad;
+	double r_inner, r_outer, start = 0, end = 0, width;
+	uint16_t *outer = NULL, *inner = NULL, outer_w, inner_w;
+	size_t outer_count, inner_count, n, i, k;
+	uint32_t *quads = NULL;
+	PyObject *sector = Py_None, *ret = NULL;
+	int fuzz = 0, err = 0;
+
+	static char *kwlist[] = {"geoquad", "r_inner", "r_outer", "fuzz", "sector", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "ldd|iO", kwlist, &geoquad, &r_inner, &r_outer, &fuzz, &sector))
+		return NULL;
+	if (r_inner > r_outer) {
+		PyErr_SetString(PyExc_ValueError, "r_inner must not be greater than r_outer");
+		return NULL;
+	}
+	if ((sector != Py_None) && !PyArg_Parse(sector, "(dd)", &start, &end)) {
+		PyErr_SetString(PyExc_TypeError, "sector must be a (start, end) tuple of bearings");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	if (((err = gq_nearby_halves((uint32_t) geoquad, r_outer, fuzz, &outer, &outer_w, &outer_count)) < 0) ||
+	    ((err = gq_nearby_halves((uint32_t) geoquad, r_inner, fuzz, &inner, &inner_w, &inner_count)) < 0) ||
+	    !(quads = malloc(sizeof(uint32_t) * (gq_nearby_total(outer, outer_count) + 1))))
+		goto computed;
+	n = cover_difference(outer, outer_w, outer_count, inner, inner_w, inner_count, quads);
+
+	/* The sector runs clockwise from start to end */
+	if (sector != Py_None) {
+		width = end - start;
+		while (width < 0)
+			width += 360.0;
+		for (i = 0, k = 0; i < n; i++)
+			if (in_sector(quads[i], (uint32_t) geoquad, start, width))
+				quads[k++] = quads[i];
+		n = k;
+	}
+computed:
+	Py_END_ALLOW_THREADS
+
+	if (quads)
+		ret = quads_to_list(quads, n);
+	else
+		nearby_error(err);
+
+	free(quads);
+	free(outer);
+	free(inner);
+	return ret;
+}
+
+static PyObject*
+geoquad_nearby_delta(PyObject *self, PyObject *args, PyObject *kw)
+{
+	long old_gq, new_gq;
+	double radius;
+	uint16_t *old = NULL, *new = NULL, old_w, new_w;
+	size_t old_count, new_count, n_total, n_added = 0, n_removed = 0;
+	uint32_t *quads = NULL;
+	PyObject *added = NULL, *removed = NULL, *ret = NULL;
+	int fuzz = 0, err = 0;
+
+	static char *kwlist[] = {"old", "new", "radius", "fuzz", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "lld|i", kwlist, &old_gq, &new_gq, &radius, &fuzz))
+		return NULL;
+
+	/* When the origin moves to a neighbor the new cover is the old one
+	 * shifted a column (or a row, which the template cache makes just as
+	 * cheap), so most columns of the difference are a single geoquad. */
+	Py_BEGIN_ALLOW_THREADS
+	if (((err = gq_nearby_halves((uint32_t) old_gq, radius, fuzz, &old, &old_w, &old_count)) < 0) ||
+	    ((err = gq_nearby_halves((uint32_t) new_gq, radius, fuzz, &new, &new_w, &new_count)) < 0))
+		goto computed;
+	/* Room for both differences */
+	n_total = gq_nearby_total(old, old_count) + gq_nearby_total(new, new_count);
+	if (!(quads = malloc(sizeof(uint32_t) * (n_total + 1))))
+		goto computed;
+	n_added = cover_difference(new, new_w, new_count, old, old_w, old_count, quads);
+	n_removed = cover_difference(old, old_w, old_count, new, new_w, new_count, quads + n_added);
+computed:
+	Py_END_ALLOW_THREADS
+	if (!quads) {
+		nearby_error(err);
+		goto done;
+	}
+
+	if (!(added = quads_to_list(quads, n_added)))
+		goto done;
+	if (!(removed = quads_to_list(quads + n_added, n_removed)))
+		goto done;
+	ret = Py_BuildValue("(OO)", added, removed);
+
+done:
+	Py_XDECREF(added);
+	Py_XDECREF(removed);
+	free(quads);
+	free(old);
+	free(new);
+	return ret;
+}
+
+/***************************
+ * BOUNDING BOX COVERS
+ *
+ * A lat/lng rectangle is an axis aligned box in the (lat half, lng half)
+ * plane, so its geoquads can be listed as Z-order ranges without visiting
+ * every cell: from a geoquad in the box we take the largest aligned block of
+ * codes starting there that's entirely inside, and from a geoquad outside we
+ * jump straight to the next one inside with BIGMIN (Tropf & Herzog, "Multi-
+ * dimensional range search in dynamically balanced trees", 1981).
+ **************************/
+
+/* The bits of the same dimension as bit @b, from @b down */
+static inline uint32_t dim_bits_below(int b)
+{
+	return ((b & 1) ? GEOQUAD_INTER32M : GEOQUAD_INTER32L) & ((2u << b) - 1);
+}
+
+/* Returns the smallest Morton code greater than @z inside the box with
+ * corners @zmin and @zmax. @z must be outside the box and less than @zmax. */
+static uint32_t
+bigmin(uint32_t z, uint32_t zmin, uint32_t zmax)
+{
+	uint32_t result = 0, bit, mask;
+	int b;
+
+	for (b = 31; b >= 0; b--) {
+		bit = 1u << b;
+		mask = dim_bits_below(b);
+		switch (((z & bit) ? 4 : 0) | ((zmin & bit) ? 2 : 0) | ((zmax & bit) ? 1 : 0)) {
+		case 1: /* z 0, min 0, max 1 */
+			result = (zmin & ~mask) | bit;
+			zmax = (zmax & ~mask) | (mask & ~bit);
+			break;
+		case 3: /* z 0, min 1, max 1 */
+			return zmin;
+		case 4: /* z 1, min 0, max 0 */
+			return result;
+		case 5: /* z 1, min 0, max 1 */
+			zmin = (zmin & ~mask) | bit;
+			break;
+		default:
+			break;
+		}
+	}
+	return result;
+}
+
+/* A growable array of lo, hi range pairs, freed with free so that covers can
+ * be built without the GIL */
+typedef struct {
+	uint32_t *ranges;
+	size_t len;
+	size_t alloc;
+} range_list;
+
+/* Adds [lo, hi] to @rl, merging with the last range if adjacent. Returns -1 if
+ * out of memory. */
+static int
+range_list_add(range_list *rl, uint32_t lo, uint32_t hi)
+{
+	uint32_t *grown;
+
+	if (rl->len && (lo == rl->ranges[2 * rl->len - 1] + 1)) {
+		rl->ranges[2 * rl->len - 1] = hi;
+		return 0;
+	}
+	if (rl->len == rl->alloc) {
+		rl->alloc = rl->alloc ? rl->alloc * 2 : 16;
+		if (!(grown = realloc(rl->ranges, sizeof(uint32_t) * 2 * rl->alloc)))
+			return -1;
+		rl->ranges = grown;
+	}
+	rl->ranges[2 * rl->len] = lo;
+	rl->ranges[2 * rl->len + 1] = hi;
+	rl->len++;
+	return 0;
+}
+
+/* Sorts the ranges of @rl, merging any that overlap or are adjacent */
+static void
+range_list_sort(range_list *rl)
+{
+	size_t i, m;
+
+	qsort(rl->ranges, rl->len, 2 * sizeof(uint32_t), compare_uint32);
+	for (i = 0, m = 0; i < rl->len; i++) {
+		if (m && (rl->ranges[2 * i] <= rl->ranges[2 * m - 1] + 1)) {
+			if (rl->ranges[2 * i + 1] > rl->ranges[2 * m - 1])
+				rl->ranges[2 * m - 1] = rl->ranges[2 * i + 1];
+		} else {
+			rl->ranges[2 * m] = rl->ranges[2 * i];
+			rl->ranges[2 * m + 1] = rl->ranges[2 * i + 1];
+			m++;
+		}
+	}
+	rl->len = m;
+}
+
+/* Appends the Z-order ranges covering the box of lat halves [@xmin, @xmax]
+ * and lng halves [@ymin, @ymax] to @rl. Returns -1 if out of memory. */
+static int
+bbox_ranges(uint16_t xmin, uint16_t ymin, uint16_t xmax, uint16_t ymax, range_list *rl)
+{
+	uint32_t zmin, zmax, z;
+	uint16_t x, y;
+	uint64_t size, end;
+	int k;
+
+	zmin = gq_interleave_full(xmin, ymin);
+	zmax = gq_interleave_full(xmax, ymax);
+	z = zmin;
+	for (;;) {
+		gq_deinterleave_full(z, &x, &y);
+		if ((x < xmin) || (x > xmax) || (y < ymin) || (y > ymax)) {
+			if (z >= zmax)
+				return 0;
+			z = bigmin(z, zmin, zmax);
+			continue;
+		}
+
+		/* Grow the aligned block at z while it stays inside the box */
+		for (k = 0; k < 16; k++) {
+			size = (uint64_t) 1 << (k + 1);
+			if ((z & ((size * size) - 1)) || (x + size - 1 > xmax) || (y + size - 1 > ymax))
+				break;
+		}
+		end = (uint64_t) z + ((uint64_t) 1 << (2 * k)) - 1;
+		if (range_list_add(rl, z, (uint32_t) end) == -1)
+			return -1;
+		if (end >= zmax)
+			return 0;
+		z = (uint32_t) end + 1;
+	}
+}
+
+static PyObject*
+geoquad_bbox_cover(PyObject *self, PyObject *args, PyObject *kw)
+{
+	double south, west, north, east;
+	int as_ranges = 1, err = 0;
+	Py_ssize_t max_ranges = 0, m;
+	range_list rl = {NULL, 0, 0};
+	uint16_t xmin, xmax;
+	uint32_t *ranges;
+	PyObject *ret = NULL;
+	Py_buffer out;
+	size_t i, total = 0;
+	uint32_t *q, z;
+
+	static char *kwlist[] = {"south", "west", "north", "east", "as_ranges", "max_ranges", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "dddd|in", kwlist, &south, &west, &north, &east, &as_ranges, &max_ranges))
+		return NULL;
+
+	if (!gq_lat_in_range(south) || !gq_lat_in_range(north) || !gq_lng_in_range(west) || !gq_lng_in_range(east)) {
+		PyErr_SetString(PyExc_ValueError, "Invalid bounding box; coordinates out of range");
+		return NULL;
+	}
+	if (south > north) {
+		PyErr_SetString(PyExc_ValueError, "Invalid bounding box; south is north of north");
+		return NULL;
+	}
+	if (max_ranges < 0) {
+		PyErr_SetString(PyExc_ValueError, "max_ranges must not be negative");
+		return NULL;
+	}
+
+	/* A box with west > east crosses the antimeridian and is split in two.
+	 * Each half's ranges are sorted, but together they need sorting again. */
+	xmin = gq_lat_to_half(south);
+	xmax = gq_lat_to_half(north);
+	if (west <= east) {
+		err = bbox_ranges(xmin, gq_lng_to_half(west), xmax, gq_lng_to_half(east), &rl);
+	} else {
+		err = bbox_ranges(xmin, gq_lng_to_half(west), xmax, gq_lng_to_half(GEOQUAD_LONGITUDE_MAX), &rl);
+		if (!err)
+			err = bbox_ranges(xmin, gq_lng_to_half(GEOQUAD_LONGITUDE_MIN), xmax, gq_lng_to_half(east), &rl);
+		if (!err)
+			range_list_sort(&rl);
+	}
+	if (err) {
+		PyErr_NoMemory();
+		goto done;
+	}
+
+	if ((m = merge_ranges(rl.ranges, rl.len, max_ranges)) == -1) {
+		PyErr_NoMemory();
+		goto done;
+	}
+	ranges = rl.ranges;
+	if (as_ranges) {
+		ret = ranges_to_list(ranges, m);
+		goto done;
+	}
+
+	for (i = 0; i < m; i++)
+		total += (size_t) (ranges[2 * i + 1] - ranges[2 * i]) + 1;
+	if (!(ret = new_array('I', total)))
+		goto done;
+	if (get_buffer(ret, &out, "quads", "I", sizeof(uint32_t), 1) == -1) {
+		Py_CLEAR(ret);
+		goto done;
+	}
+	q = out.buf;
+	for (i = 0; i < m; i++) {
+		z = ranges[2 * i];
+		do {
+			*q++ = z;
+		} while (z++ != ranges[2 * i + 1]);
+	}
+	PyBuffer_Release(&out);
+
+done:
+	free(rl.ranges);
+	return ret;
+}
+
+/***************************
+ * POLYGON COVERS
+ *
+ * Polygons are rasterized in half coordinates (x is the lat half, y the lng
+ * half, cell (x, y) spans [x, x + 1) by [y, y + 1)). Every cell an edge
+ * passes through is a boundary cell; every other cell is either entirely
+ * inside or entirely outside, so a scanline through the cell centers of each
+ * row classifies the rest. The even-odd rule is used, so holes and
+ * multipolygons are just more rings.
+ **************************/
+
+/* An edge, with x1 <= x2 */
+typedef struct {
+	double x1, y1, x2, y2;
+} poly_edge;
+
+#define CELL_BOUNDARY 1
+#define CELL_INTERIOR 2
+
+static int
+compare_edge(const void *a, const void *b)
+{
+	double x = ((const poly_edge *) a)->x1, y = ((const poly_edge *) b)->x1;
+	return (x > y) - (x < y);
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* Reads @rings into a newly allocated array of edges. Returns the number of
+ * edges, or -1 with an exception set. */
+static Py_ssize_t
+polygon_edges(PyObject *rings, poly_edge **edges_out)
+{
+	PyObject *rings_fast = NULL, *ring = NULL;
+	poly_edge *edges = NULL, *grown, *e;
+	Py_ssize_t nedges = 0, alloc = 0, i, j, n;
+	double lat, lng, x, y, x0 = 0, y0 = 0, px = 0, py = 0;
+
+	if (!(rings_fast = PySequence_Fast(rings, "rings must be a sequence of rings")))
+		return -1;
+	for (i = 0; i < PySequence_Fast_GET_SIZE(rings_fast); i++) {
+		if (!(ring = PySequence_Fast(PySequence_Fast_GET_ITEM(rings_fast, i), "rings must be sequences of (lat, lng) points")))
+			goto error;
+		n = PySequence_Fast_GET_SIZE(ring);
+		if (n < 3) {
+			PyErr_SetString(PyExc_ValueError, "rings must have at least three points");
+			goto error;
+		}
+		if (nedges + n > alloc) {
+			alloc = (nedges + n) * 2;
+			if (!(grown = PyMem_Realloc(edges, sizeof(poly_edge) * alloc))) {
+				PyErr_NoMemory();
+				goto error;
+			}
+			edges = grown;
+		}
+		for (j = 0; j <= n; j++) {
+			if (j < n) {
+				if (!PyArg_Parse(PySequence_Fast_GET_ITEM(ring, j), "(dd)", &lat, &lng))
+					goto error;
+				if (!gq_lat_in_range(lat) || !gq_lng_in_range(lng)) {
+					PyErr_Format(PyExc_ValueError, "Invalid point (%.2f, %.2f) in ring %zd", lat, lng, i);
+					goto error;
+				}
+				x = (lat - GEOQUAD_LATITUDE_MIN) * GEOQUAD_INV;
+				y = (lng - GEOQUAD_LONGITUDE_MIN) * GEOQUAD_INV;
+			} else {
+				x = x0;
+				y = y0;
+			}
+			if (j == 0) {
+				x0 = x;
+				y0 = y;
+			} else {
+				e = &edges[nedges++];
+				if (px <= x) {
+					e->x1 = px; e->y1 = py; e->x2 = x; e->y2 = y;
+				} else {
+					e->x1 = x; e->y1 = y; e->x2 = px; e->y2 = py;
+				}
+			}
+			px = x;
+			py = y;
+		}
+		Py_CLEAR(ring);
+	}
+	Py_DECREF(rings_fast);
+	*edges_out = edges;
+	return nedges;
+
+error:
+	Py_XDECREF(ring);
+	Py_DECREF(rings_fast);
+	PyMem_Free(edges);
+	return -1;
+}
+
+/* Marks every cell of @cells that @e passes through as a boundary cell */
+static void
+mark_edge(const poly_edge *e, uint8_t *cells, int xmin, int ymin, int ymax, int width)
+{
+	double slope = 0, lo, hi, ya, yb;
+	int x, y, y0, y1;
+
+	if (e->x2 > e->x1)
+		slope = (e->y2 - e->y1) / (e->x2 - e->x1);
+	for (x = (int) e->x1; x <= (int) e->x2; x++) {
+		lo = (x > e->x1) ? x : e->x1;
+		hi = (x + 1 < e->x2) ? x + 1 : e->x2;
+		if (e->x2 > e->x1) {
+			ya = e->y1 + (lo - e->x1) * slope;
+			yb = e->y1 + (hi - e->x1) * slope;
+		} else {
+			ya = e->y1;
+			yb = e->y2;
+		}
+		y0 = (int) ((ya < yb) ? ya : yb);
+		y1 = (int) ((ya < yb) ? yb : ya);
+		if (y0 < ymin)
+			y0 = ymin;
+		if (y1 > ymax)
+			y1 = ymax;
+		for (y = y0; y <= y1; y++)
+			cells[(x - xmin) * width + (y - ymin)] = CELL_BOUNDARY;
+	}
+}
+
+/* Marks the non-boundary cells of each row whose centers are inside the
+ * polygon as interior cells, with an active edge list over @edges sorted by
+ * x1. Returns -1 if out of memory. */
+static int
+mark_interior(const poly_edge *edges, Py_ssize_t nedges, uint8_t *cells, int xmin, int xmax, int ymin, int ymax, int width)
+{
+	Py_ssize_t *active, nactive = 0, next = 0, i, k;
+	double *crossings, c;
+	const poly_edge *e;
+	int x, y, y0, y1;
+
+	active = PyMem_Malloc(sizeof(Py_ssize_t) * (nedges + 1));
+	crossings = PyMem_Malloc(sizeof(double) * (nedges + 1));
+	if (!active || !crossings) {
+		PyMem_Free(active);
+		PyMem_Free(crossings);
+		return -1;
+	}
+
+	for (x = xmin; x <= xmax; x++) {
+		c = x + 0.5;
+		while (next < nedges && edges[next].x1 <= c)
+			active[nactive++] = next++;
+
+		/* Keep the edges crossing the scanline, with the half open rule
+		 * x1 <= c < x2 so shared vertices are counted once */
+		for (i = 0, k = 0; i < nactive; i++) {
+			e = &edges[active[i]];
+			if (e->x2 <= c)
+				continue;
+			active[k] = active[i];
+			crossings[k++] = e->y1 + (c - e->x1) * (e->y2 - e->y1) / (e->x2 - e->x1);
+		}
+		nactive = k;
+		qsort(crossings, nactive, sizeof(double), compare_double);
+
+		for (i = 0; i + 1 < nactive; i += 2) {
+			y0 = (int) ceil(crossings[i] - 0.5);
+			y1 = (int) floor(crossings[i + 1] - 0.5);
+			if (y0 < ymin)
+				y0 = ymin;
+			if (y1 > ymax)
+				y1 = ymax;
+			for (y = y0; y <= y1; y++)
+				if (!cells[(x - xmin) * width + (y - ymin)])
+					cells[(x - xmin) * width + (y - ymin)] = CELL_INTERIOR;
+		}
+	}
+
+	PyMem_Free(active);
+	PyMem_Free(crossings);
+	return 0;
+}
+
+/* Returns a sorted array('I') of the cells marked @kind */
+static PyObject*
+cells_to_array(const uint8_t *cells, int xmin, int ymin, int width, size_t ncells, uint8_t kind, size_t count)
+{
+	PyObject *ret;
+	Py_buffer view;
+	uint32_t *q;
+	size_t i;
+
+	if (!(ret = new_array('I', count)))
+		return NULL;
+	if (get_buffer(ret, &view, "quads", "I", sizeof(uint32_t), 1) == -1) {
+		Py_DECREF(ret);
+		return NULL;
+	}
+	q = view.buf;
+	for (i = 0; i < ncells; i++)
+		if (cells[i] == kind)
+			*q++ = gq_interleave_full(xmin + i / width, ymin + i % width);
+	if (sort_uint32(view.buf, count) == -1) {
+		PyBuffer_Release(&view);
+		Py_DECREF(ret);
+		return PyErr_NoMemory();
+	}
+	PyBuffer_Release(&view);
+	return ret;
+}
+
+static PyObject*
+geoquad_polygon_cover(PyObject *self, PyObject *args, PyObject *kw)
+{
+	PyObject *rings, *interior = NULL, *boundary = NULL, *ret = NULL;
+	poly_edge *edges = NULL;
+	Py_ssize_t nedges, i;
+	uint8_t *cells = NULL;
+	size_t ncells, j, counts[3] = {0, 0, 0};
+	double x_lo, x_hi, y_lo, y_hi;
+	int xmin, xmax, ymin, ymax, width;
+
+	static char *kwlist[] = {"rings", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "O", kwlist, &rings))
+		return NULL;
+	if ((nedges = polygon_edges(rings, &edges)) == -1)
+		return NULL;
+	if (!nedges) {
+		PyErr_SetString(PyExc_ValueError, "rings must not be empty");
+		goto done;
+	}
+
+	x_lo = x_hi = edges[0].x1;
+	y_lo = y_hi = edges[0].y1;
+	for (i = 0; i < nedges; i++) {
+		x_lo = (edges[i].x1 < x_lo) ? edges[i].x1 : x_lo;
+		x_hi = (edges[i].x2 > x_hi) ? edges[i].x2 : x_hi;
+		y_lo = (edges[i].y1 < y_lo) ? edges[i].y1 : y_lo;
+		y_lo = (edges[i].y2 < y_lo) ? edges[i].y2 : y_lo;
+		y_hi = (edges[i].y1 > y_hi) ? edges[i].y1 : y_hi;
+		y_hi = (edges[i].y2 > y_hi) ? edges[i].y2 : y_hi;
+	}
+	xmin = (int) x_lo;
+	xmax = (int) x_hi;
+	ymin = (int) y_lo;
+	ymax = (int) y_hi;
+	width = ymax - ymin + 1;
+	ncells = (size_t) (xmax - xmin + 1) * width;
+	if (!(cells = PyMem_Malloc(ncells))) {
+		PyErr_NoMemory();
+		goto done;
+	}
+	memset(cells, 0, ncells);
+
+	for (i = 0; i < nedges; i++)
+		mark_edge(&edges[i], cells, xmin, ymin, ymax, width);
+	qsort(edges, nedges, sizeof(poly_edge), compare_edge);
+	if (mark_interior(edges, nedges, cells, xmin, xmax, ymin, ymax, width) == -1) {
+		PyErr_NoMemory();
+		goto done;
+	}
+
+	for (j = 0; j < ncells; j++)
+		counts[cells[j]]++;
+	if (!(interior = cells_to_array(cells, xmin, ymin, width, ncells, CELL_INTERIOR, counts[CELL_INTERIOR])))
+		goto done;
+	if (!(boundary = cells_to_array(cells, xmin, ymin, width, ncells, CELL_BOUNDARY, counts[CELL_BOUNDARY])))
+		goto done;
+	ret = Py_BuildValue("(OO)", interior, boundary);
+
+done:
+	Py_XDECREF(interior);
+	Py_XDECREF(boundary);
+	PyMem_Free(cells);
+	PyMem_Free(edges);
+	return ret;
+}
+
+/***************************
+ * PARALLEL RADIX SORT
+ *
+ * Sorts records by geoquad with an LSD radix sort over the key bytes,
+ * carrying a permutation of the record numbers along. Every pass is stable,
+ * so records with the same geoquad stay in input order. The work is split
+ * into phases run by up to RADIX_MAX_THREADS threads, each on its own chunk
+ * of the records: encoding the keys, then for each byte histogramming and
+ * scattering, and finally gathering the records' columns. A thread's
+ * scatter position for a byte value is the count of smaller values plus the
+ * count of that value in earlier chunks, all computed between phases from
+ * the per chunk histograms. Passes where every key has the same byte, like
+ * the top byte of most geoquads, are skipped.
+ **************************/
+
+#define RADIX_BITS         8
+#define RADIX_SIZE         (1 << RADIX_BITS)
+#define RADIX_MAX_THREADS  64
+#define RADIX_MIN_CHUNK    65536  /* records per thread */
+
+enum { RADIX_ENCODE, RADIX_SCATTER, RADIX_HISTOGRAM, RADIX_GATHER };
+
+typedef struct radix_job radix_job;
+
+typedef struct {
+	radix_job *job;
+	size_t lo, hi;             /* this thread's chunk */
+	size_t hist[RADIX_SIZE];   /* of the next pass's byte */
+	size_t pos[RADIX_SIZE];    /* scatter positions */
+	size_t bad;                /* first invalid record, or SIZE_MAX */
+} radix_worker;
+
+struct radix_job {
+	int phase;
+	int shift;                 /* of the byte being scattered */
+	int next_shift;            /* of the byte to histogram */
+	int src;                   /* which of the buffers is current */
+	uint32_t *keys[2];
+	uint32_t *perm[2];
+	const double *lats, *lngs; /* input columns */
+	const int64_t *ids;
+	int64_t *out_ids;          /* gathered output columns */
+	double *out_lats, *out_lngs;
+	int nthreads;
+	radix_worker workers[RADIX_MAX_THREADS];
+};
+
+static void*
+radix_worker_run(void *arg)
+{
+	radix_worker *w = arg;
+	radix_job *job = w->job;
+	uint32_t *keys = job->keys[job->src], *perm = job->perm[job->src];
+	uint32_t *dkeys = job->keys[job->src ^ 1], *dperm = job->perm[job->src ^ 1];
+	size_t i, r;
+	uint32_t d;
+
+	switch (job->phase) {
+	case RADIX_ENCODE:
+		for (i = w->lo; i < w->hi; i++) {
+			if (!gq_lat_in_range(job->lats[i]) || !gq_lng_in_range(job->lngs[i])) {
+				if (w->bad == SIZE_MAX)
+					w->bad = i;
+				keys[i] = 0;
+			} else {
+				keys[i] = gq_interleave_full(gq_lat_to_half(job->lats[i]), gq_lng_to_half(job->lngs[i]));
+			}
+			perm[i] = (uint32_t) i;
+		}
+		break;
+	case RADIX_SCATTER:
+		for (i = w->lo; i < w->hi; i++) {
+			d = (keys[i] >> job->shift) & (RADIX_SIZE - 1);
+			dkeys[w->pos[d]] = keys[i];
+			dperm[w->pos[d]++] = perm[i];
+		}
+		return NULL;
+	case RADIX_GATHER:
+		for (i = w->lo; i < w->hi; i++) {
+			r = perm[i];
+			job->out_ids[i] = job->ids[r];
+			job->out_lats[i] = job->lats[r];
+			job->out_lngs[i] = job->lngs[r];
+		}
+		return NULL;
+	default:
+		break;
+	}
+
+	memset(w->hist, 0, sizeof(w->hist));
+	for (i = w->lo; i < w->hi; i++)
+		w->hist[(keys[i] >> job->next_shift) & (RADIX_SIZE - 1)]++;
+	return NULL;
+}
+
+/* Runs the current phase of @job on every worker. A worker whose thread
+ * can't be started is just run on this one. */
+static void
+radix_run(radix_job *job)
+{
+	pthread_t threads[RADIX_MAX_THREADS];
+	int started[RADIX_MAX_THREADS];
+	int t;
+
+	for (t = 1; t < job->nthreads; t++)
+		started[t] = !pthread_create(&threads[t], NULL, radix_worker_run, &job->workers[t]);
+	radix_worker_run(&job->workers[0]);
+	for (t = 1; t < job->nthreads; t++) {
+		if (started[t])
+			pthread_join(threads[t], NULL);
+		else
+			radix_worker_run(&job->workers[t]);
+	}
+}
+
+/* Encodes, sorts and gathers the @n records set up in @job with @nthreads
+ * threads, leaving the sorted keys in job->keys[job->src]. Returns the first
+ * invalid record, or SIZE_MAX if all are valid.
+ * Doesn't touch any Python objects, so it can run without the GIL. */
+static size_t
+radix_build(radix_job *job, size_t n, int nthreads)
+{
+	size_t base, total[RADIX_SIZE], bad = SIZE_MAX;
+	int t, d, shift, skip;
+
+	job->nthreads = nthreads;
+	for (t = 0; t < nthreads; t++) {
+		job->workers[t].job = job;
+		job->workers[t].lo = n * t / nthreads;
+		job->workers[t].hi = n * (t + 1) / nthreads;
+		job->workers[t].bad = SIZE_MAX;
+	}
+
+	job->src = 0;
+	job->phase = RADIX_ENCODE;
+	job->next_shift = 0;
+	radix_run(job);
+	for (t = 0; t < nthreads; t++)
+		if (job->workers[t].bad < bad)
+			bad = job->workers[t].bad;
+	if (bad != SIZE_MAX)
+		return bad;
+
+	for (shift = 0; shift < 32; shift += RADIX_BITS) {
+		memset(total, 0, sizeof(total));
+		for (t = 0; t < nthreads; t++)
+			for (d = 0; d < RADIX_SIZE; d++)
+				total[d] += job->workers[t].hist[d];
+		for (d = 0, skip = 0; d < RADIX_SIZE; d++)
+			skip |= (total[d] == n);
+
+		if (!skip) {
+			for (d = 0, base = 0; d < RADIX_SIZE; d++) {
+				for (t = 0; t < nthreads; t++) {
+					job->workers[t].pos[d] = base;
+					base += job->workers[t].hist[d];
+				}
+			}
+			job->phase = RADIX_SCATTER;
+			job->shift = shift;
+			radix_run(job);
+			job->src ^= 1;
+		}
+
+		/* The chunks' histograms of the next byte, in the new order */
+		if (shift + RADIX_BITS < 32) {
+			job->phase = RADIX_HISTOGRAM;
+			job->next_shift = shift + RADIX_BITS;
+			radix_run(job);
+		}
+	}
+
+	job->phase = RADIX_GATHER;
+	radix_run(job);
+	return SIZE_MAX;
+}
+
+/* The number of threads to sort @n records with, given the number asked
+ * for. With 0 it's one per CPU, as long as each gets RADIX_MIN_CHUNK
+ * records. */
+static int
+radix_threads(size_t n, int threads)
+{
+	long cpus;
+
+	if (threads <= 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cpus > 0) ? (int) cpus : 1;
+		if ((size_t) threads > n / RADIX_MIN_CHUNK)
+			threads = (int) (n / RADIX_MIN_CHUNK);
+	}
+	if ((size_t) threads > n)
+		threads = (int) n;
+	if (threads > RADIX_MAX_THREADS)
+		threads = RADIX_MAX_THREADS;
+	return (threads < 1) ? 1 : threads;
+}
+
+/***************************
+ * GEO INDEX
+ *
+ * A static index of (id, lat, lng) records. The records are sorted by
+ * geoquad and stored in flat arrays: the distinct geoquads are in @keys, and
+ * the records of keys[i] are [offsets[i], offsets[i + 1]) in @ids, @lats and
+ * @lngs, CSR style. A range of geoquads is therefore a range of records.
+ **************************/
+
+typedef struct {
+	PyObject_HEAD
+	size_t n;           /* number of records */
+	size_t nkeys;       /* number of distinct geoquads */
+	uint32_t *keys;
+	uint64_t *offsets;  /* nkeys + 1 of them */
+	int64_t *ids;
+	double *lats;
+	double *lngs;
+	void *map;          /* the file mapping the arrays are in, if loaded */
+	size_t map_size;
+} GeoIndexObject;
+
+/* The widest longitude, in degrees either side of the origin, of the part
+ * of the circle (angular radius @c around latitude @lat0, both radians) that
+ * lies between latitudes @lo and @hi (degrees). Returns -1 if that part is
+ * empty and 180 if it goes all the way around.
+ *
+ * On a latitude phi the circle spans the longitudes where
+ *
+ *   cos(dlng) >= (cos(c) - sin(lat0) sin(phi)) / (cos(lat0) cos(phi))
+ *
+ * which is widest at sin(phi) = sin(lat0) / cos(c), so it's enough to check
+ * that latitude (if it's in the band) and the band's edges.
+ */
+static double
+band_extent(double lat0, double c, double lo, double hi)
+{
+	double phis[3], phi, denom, cosd, widest = -1.0;
+	int i, n = 0;
+
+	phis[n++] = TO_RADIANS(lo);
+	phis[n++] = TO_RADIANS(hi);
+	if (fabs(sin(lat0)) < cos(c)) {
+		phi = asin(sin(lat0) / cos(c));
+		if ((phi > phis[0]) && (phi < phis[1]))
+			phis[n++] = phi;
+	}
+
+	for (i = 0; i < n; i++) {
+		denom = cos(lat0) * cos(phis[i]);
+		if (denom < 1e-15)
+			return 180.0;
+		cosd = (cos(c) - sin(lat0) * sin(phis[i])) / denom;
+		if (cosd <= -1.0)
+			return 180.0;
+
+		/* The band edges at the top and bottom of the circle give
+		 * cosd == 1 up to rounding */
+		if (cosd > 1.0 + 1e-9)
+			continue;
+		phi = acos((cosd < 1.0) ? cosd : 1.0) * 180.0 / M_PI;
+		if (phi > widest)
+			widest = phi;
+	}
+	return widest;
+}
+
+/* A region made of one interval of lng halves [lo[i], hi[i]] per row of lat
+ * halves x0 + i, up to x1. Empty rows have lo > hi. */
+typedef struct {
+	int x0, x1;
+	const int *lo, *hi;
+} row_region;
+
+/* Appends the Z-order ranges covering @rg within the aligned block of 4^@level
+ * geoquads at (@bx, @by) to @rl, descending only into blocks that are partly
+ * inside. The ranges come out sorted. Returns -1 if out of memory. */
+static int
+region_ranges(const row_region *rg, int bx, int by, int level, range_list *rl)
+{
+	int s = 1 << level, x, x_lo, x_hi, any = 0, full, c;
+	uint64_t z;
+
+	x_lo = (bx > rg->x0) ? bx : rg->x0;
+	x_hi = (bx + s - 1 < rg->x1) ? bx + s - 1 : rg->x1;
+	full = (x_lo == bx) && (x_hi == bx + s - 1);
+	for (x = x_lo; x <= x_hi; x++) {
+		if ((rg->lo[x - rg->x0] <= by + s - 1) && (rg->hi[x - rg->x0] >= by))
+			any = 1;
+		if ((rg->lo[x - rg->x0] > by) || (rg->hi[x - rg->x0] < by + s - 1))
+			full = 0;
+	}
+	if (!any)
+		return 0;
+	if (full) {
+		z = gq_interleave_full((uint16_t) bx, (uint16_t) by);
+		return range_list_add(rl, (uint32_t) z, (uint32_t) (z + (uint64_t) s * s - 1));
+	}
+
+	/* Children in Z order: x is the low bit */
+	s >>= 1;
+	for (c = 0; c < 4; c++)
+		if (region_ranges(rg, bx + (c & 1) * s, by + (c >> 1) * s, level - 1, rl) == -1)
+			return -1;
+	return 0;
+}
+
+/* Appends Z-order ranges covering every geoquad within @radius miles of
+ * (@lat, @lng) to @rl, sorted. Unlike gq_nearby_halves this works in true
+ * lat/lng: each row of geoquads in the circle's latitude range is clipped to
+ * the circle's widest extent over that row, with rows that cross the
+ * antimeridian split into two regions. Returns -1 if out of memory.
+ * Doesn't need the GIL. */
+static int
+radius_ranges(double lat, double lng, double radius, range_list *rl)
+{
+	double c, dlat, lat0, lat_lo, lat_hi, row, lo, hi, widest;
+	int x, x0, x1, rows, y_max = gq_lng_to_half(GEOQUAD_LONGITUDE_MAX), err = 0;
+	int *bounds;
+	row_region east, west;
+
+	/* Pad the radius a little so that rounding never drops a geoquad */
+	c = radius / GEOQUAD_EARTH_RADIUS_MI + 1e-12;
+	if (c < 0)
+		return 0;
+	if (c >= M_PI)
+		return bbox_ranges(0, 0, gq_lat_to_half(GEOQUAD_LATITUDE_MAX), y_max, rl);
+
+	dlat = c * 180.0 / M_PI;
+	lat_lo = (lat - dlat > GEOQUAD_LATITUDE_MIN) ? lat - dlat : GEOQUAD_LATITUDE_MIN;
+	lat_hi = (lat + dlat < GEOQUAD_LATITUDE_MAX) ? lat + dlat : GEOQUAD_LATITUDE_MAX;
+	x0 = gq_lat_to_half(lat_lo);
+	x1 = gq_lat_to_half(lat_hi);
+	rows = x1 - x0 + 1;
+	lat0 = TO_RADIANS(lat);
+
+	/* The rows' main intervals and the parts wrapped around the
+	 * antimeridian, which are usually empty */
+	if (!(bounds = malloc(sizeof(int) * 4 * rows)))
+		return -1;
+	east.x0 = west.x0 = x0;
+	east.x1 = west.x1 = x1;
+	east.lo = bounds;
+	east.hi = bounds + rows;
+	west.lo = bounds + 2 * rows;
+	west.hi = bounds + 3 * rows;
+
+	for (x = x0; x <= x1; x++) {
+		bounds[x - x0] = bounds[2 * rows + x - x0] = 1;
+		bounds[rows + x - x0] = bounds[3 * rows + x - x0] = 0;
+
+		row = (x * GEOQUAD_STEP) + GEOQUAD_LATITUDE_MIN;
+		lo = (row > lat_lo) ? row : lat_lo;
+		hi = (row + GEOQUAD_STEP < lat_hi) ? row + GEOQUAD_STEP : lat_hi;
+		if ((widest = band_extent(lat0, c, lo, hi)) < 0)
+			continue;
+		widest += 1e-9;
+
+		if (widest >= 180.0) {
+			bounds[x - x0] = 0;
+			bounds[rows + x - x0] = y_max;
+			continue;
+		}
+		bounds[x - x0] = (lng - widest < GEOQUAD_LONGITUDE_MIN) ? 0 : gq_lng_to_half(lng - widest);
+		bounds[rows + x - x0] = (lng + widest > GEOQUAD_LONGITUDE_MAX) ? y_max : gq_lng_to_half(lng + widest);
+		if (lng - widest < GEOQUAD_LONGITUDE_MIN) {
+			bounds[2 * rows + x - x0] = gq_lng_to_half(lng - widest + 360.0);
+			bounds[3 * rows + x - x0] = y_max;
+		} else if (lng + widest > GEOQUAD_LONGITUDE_MAX) {
+			bounds[2 * rows + x - x0] = 0;
+			bounds[3 * rows + x - x0] = gq_lng_to_half(lng + widest - 360.0);
+		}
+	}
+
+	err = region_ranges(&east, 0, 0, 16, rl);
+	if (!err && region_ranges(&west, 0, 0, 16, rl) == -1)
+		err = -1;
+	if (!err)
+		range_list_sort(rl);
+	free(bounds);
+	return err;
+}
+
+/* The index of the first key >= @z */
+static size_t
+geoindex_lower_bound(const GeoIndexObject *index, uint32_t z)
+{
+	size_t lo = 0, hi = index->nkeys, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		if (index->keys[mid] < z)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static PyObject*
+geoindex_new(PyTypeObject *type, PyObject *args, PyObject *kw)
+{
+	PyObject *ids_obj, *lats_obj, *lngs_obj;
+	Py_buffer ids, lats, lngs;
+	GeoIndexObject *index = NULL;
+	radix_job *job = NULL;
+	const uint32_t *sorted;
+	size_t i, k, n, bad;
+	int threads = 0;
+
+	static char *kwlist[] = {"ids", "lats", "lngs", "threads", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "OOO|i", kwlist, &ids_obj, &lats_obj, &lngs_obj, &threads))
+		return NULL;
+
+	/* ids are 64 bit, e.g. array('l') */
+	if (get_buffer(ids_obj, &ids, "ids", "lq", sizeof(int64_t), 0) == -1)
+		return NULL;
+	if (get_buffer(lats_obj, &lats, "lats", "d", sizeof(double), 0) == -1)
+		goto release_ids;
+	if (get_buffer(lngs_obj, &lngs, "lngs", "d", sizeof(double), 0) == -1)
+		goto release_lats;
+
+	n = ids.len / sizeof(int64_t);
+	if ((lats.len / sizeof(double) != n) || (lngs.len / sizeof(double) != n)) {
+		PyErr_SetString(PyExc_ValueError, "ids, lats and lngs must have the same length");
+		goto release_lngs;
+	}
+	if (n > UINT32_MAX) {
+		PyErr_SetString(PyExc_ValueError, "Too many records");
+		goto release_lngs;
+	}
+
+	if (!(index = (GeoIndexObject *) type->tp_alloc(type, 0)))
+		goto release_lngs;
+	index->n = n;
+	index->ids = PyMem_Malloc(sizeof(int64_t) * (n + 1));
+	index->lats = PyMem_Malloc(sizeof(double) * (n + 1));
+	index->lngs = PyMem_Malloc(sizeof(double) * (n + 1));
+	job = PyMem_Malloc(sizeof(radix_job));
+	if (job) {
+		memset(job, 0, sizeof(radix_job));
+		for (i = 0; i < 2; i++) {
+			job->keys[i] = PyMem_Malloc(sizeof(uint32_t) * (n + 1));
+			job->perm[i] = PyMem_Malloc(sizeof(uint32_t) * (n + 1));
+		}
+	}
+	if (!index->ids || !index->lats || !index->lngs || !job || !job->keys[0] || !job->keys[1] || !job->perm[0] || !job->perm[1]) {
+		PyErr_NoMemory();
+		goto error;
+	}
+
+	/* Sort the records by geoquad, keeping records with the same geoquad
+	 * in input order */
+	job->lats = lats.buf;
+	job->lngs = lngs.buf;
+	job->ids = ids.buf;
+	job->out_ids = index->ids;
+	job->out_lats = index->lats;
+	job->out_lngs = index->lngs;
+	threads = radix_threads(n, threads);
+	BEGIN_ALLOW_THREADS_IF(view_nogil(&ids) && view_nogil(&lats) && view_nogil(&lngs))
+	bad = radix_build(job, n, threads);
+	END_ALLOW_THREADS_FOR
+	if (bad != SIZE_MAX) {
+		PyErr_Format(PyExc_ValueError, "Invalid coordinates (%.2f, %.2f) for record %zd",
+			((const double *) lats.buf)[bad], ((const double *) lngs.buf)[bad], bad);
+		goto error;
+	}
+
+	sorted = job->keys[job->src];
+	for (i = 0, k = 0; i < n; i++)
+		if (!i || (sorted[i] != sorted[i - 1]))
+			k++;
+	index->nkeys = k;
+	index->keys = PyMem_Malloc(sizeof(uint32_t) * (k + 1));
+	index->offsets = PyMem_Malloc(sizeof(uint64_t) * (k + 1));
+	if (!index->keys || !index->offsets) {
+		PyErr_NoMemory();
+		goto error;
+	}
+	for (i = 0, k = 0; i < n; i++) {
+		if (!i || (sorted[i] != sorted[i - 1])) {
+			index->keys[k] = sorted[i];
+			index->offsets[k++] = i;
+		}
+	}
+	index->offsets[k] = n;
+	goto release_job;
+
+error:
+	Py_CLEAR(index);
+release_job:
+	if (job) {
+		for (i = 0; i < 2; i++) {
+			PyMem_Free(job->keys[i]);
+			PyMem_Free(job->perm[i]);
+		}
+		PyMem_Free(job);
+	}
+release_lngs:
+	PyBuffer_Release(&lngs);
+release_lats:
+	PyBuffer_Release(&lats);
+release_ids:
+	PyBuffer_Release(&ids);
+	return (PyObject *) index;
+}
+
+static void
+geoindex_dealloc(GeoIndexObject *index)
+{
+	if (index->map) {
+		munmap(index->map, index->map_size);
+	} else {
+		PyMem_Free(index->keys);
+		PyMem_Free(index->offsets);
+		PyMem_Free(index->ids);
+		PyMem_Free(index->lats);
+		PyMem_Free(index->lngs);
+	}
+	Py_TYPE(index)->tp_free((PyObject *) index);
+}
+
+static Py_ssize_t
+geoindex_length(GeoIndexObject *index)
+{
+	return (Py_ssize_t) index->n;
+}
+
+/* Returns the ids in @found as an array('l') */
+static PyObject*
+ids_to_array(const int64_t *found, size_t n)
+{
+	PyObject *ret;
+	Py_buffer view;
+
+	if (!(ret = new_array('l', n)))
+		return NULL;
+	if (get_buffer(ret, &view, "ids", "lq", sizeof(int64_t), 1) == -1) {
+		Py_DECREF(ret);
+		return NULL;
+	}
+	if (n)
+		memcpy(view.buf, found, sizeof(int64_t) * n);
+	PyBuffer_Release(&view);
+	return ret;
+}
+
+static PyObject*
+geoindex_query_radius(GeoIndexObject *index, PyObject *args, PyObject *kw)
+{
+	double lat, lng, radius;
+	range_list rl = {NULL, 0, 0};
+	int64_t *found = NULL, *grown;
+	size_t i, k, nfound = 0, alloc = 0;
+	uint64_t r;
+	int err = 0;
+	PyObject *ret = NULL;
+
+	static char *kwlist[] = {"lat", "lng", "radius", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "ddd", kwlist, &lat, &lng, &radius))
+		return NULL;
+	if (!gq_lat_in_range(lat) || !gq_lng_in_range(lng)) {
+		PyErr_SetString(PyExc_ValueError, "Invalid coordinates");
+		return NULL;
+	}
+	if (!(radius >= 0)) {
+		PyErr_SetString(PyExc_ValueError, "radius must be a nonnegative number");
+		return NULL;
+	}
+
+	/* The index is never modified, so it can be read without the GIL */
+	Py_BEGIN_ALLOW_THREADS
+	if ((err = radius_ranges(lat, lng, radius, &rl)) == -1)
+		goto scanned;
+	for (i = 0; i < rl.len; i++) {
+		for (k = geoindex_lower_bound(index, rl.ranges[2 * i]); (k < index->nkeys) && (index->keys[k] <= rl.ranges[2 * i + 1]); k++) {
+			for (r = index->offsets[k]; r < index->offsets[k + 1]; r++) {
+				if (gq_haversine_distance(lat, lng, index->lats[r], index->lngs[r]) > radius)
+					continue;
+				if (nfound == alloc) {
+					alloc = alloc ? alloc * 2 : 64;
+					if (!(grown = realloc(found, sizeof(int64_t) * alloc))) {
+						err = -1;
+						goto scanned;
+					}
+					found = grown;
+				}
+				found[nfound++] = index->ids[r];
+			}
+		}
+	}
+scanned:
+	Py_END_ALLOW_THREADS
+
+	if (err)
+		PyErr_NoMemory();
+	else
+		ret = ids_to_array(found, nfound);
+
+	free(found);
+	free(rl.ranges);
+	return ret;
+}
+
+/* A bounded max-heap of the k nearest records seen so far */
+typedef struct {
+	double *dists;
+	int64_t *ids;
+	size_t len, k;
+} knn_heap;
+
+static void
+knn_heap_sift_down(knn_heap *h, size_t i)
+{
+	size_t c;
+	double d;
+	int64_t id;
+
+	for (;;) {
+		c = 2 * i + 1;
+		if (c >= h->len)
+			return;
+		if ((c + 1 < h->len) && (h->dists[c + 1] > h->dists[c]))
+			c++;
+		if (h->dists[c] <= h->dists[i])
+			return;
+		d = h->dists[i];
+		h->dists[i] = h->dists[c];
+		h->dists[c] = d;
+		id = h->ids[i];
+		h->ids[i] = h->ids[c];
+		h->ids[c] = id;
+		i = c;
+	}
+}
+
+static void
+knn_heap_push(knn_heap *h, double dist, int64_t id)
+{
+	size_t i, p;
+
+	if (h->len == h->k) {
+		if (dist >= h->dists[0])
+			return;
+		h->dists[0] = dist;
+		h->ids[0] = id;
+		knn_heap_sift_down(h, 0);
+		return;
+	}
+
+	i = h->len++;
+	while (i && (h->dists[p = (i - 1) / 2] < dist)) {
+		h->dists[i] = h->dists[p];
+		h->ids[i] = h->ids[p];
+		i = p;
+	}
+	h->dists[i] = dist;
+	h->ids[i] = id;
+}
+
+/* Pushes the records of the geoquad at (@x, @y) to @h */
+static void
+knn_visit(const GeoIndexObject *index, knn_heap *h, double lat, double lng, int x, int y)
+{
+	size_t k;
+	uint64_t r;
+	uint32_t z = gq_interleave_full((uint16_t) x, (uint16_t) y);
+
+	k = geoindex_lower_bound(index, z);
+	if ((k == index->nkeys) || (index->keys[k] != z))
+		return;
+	for (r = index->offsets[k]; r < index->offsets[k + 1]; r++)
+		knn_heap_push(h, gq_haversine_distance(lat, lng, index->lats[r], index->lngs[r]), index->ids[r]);
+}
+
+/* The distance in miles from latitude @lat to the nearest point of a
+ * meridian @dlng degrees away, which is on the great circle through it
+ * unless the meridian is more than a quarter turn away, when it's a pole */
+static double
+meridian_distance(double lat, double dlng)
+{
+	if (dlng > 180.0)
+		dlng = 360.0 - dlng;
+	lat = TO_RADIANS(lat);
+	if (dlng >= 90.0)
+		return GEOQUAD_EARTH_RADIUS_MI * (M_PI / 2 - fabs(lat));
+	dlng = TO_RADIANS(dlng);
+	return GEOQUAD_EARTH_RADIUS_MI * asin(cos(lat) * sin(dlng));
+}
+
+static PyObject*
+geoindex_knn(GeoIndexObject *index, PyObject *args, PyObject *kw)
+{
+	double lat, lng, bound, b, edge;
+	Py_ssize_t k;
+	knn_heap h = {NULL, NULL, 0, 0};
+	int x0, y0, x, y, a, a_old, b_cols, b_old, w, w_old, x_max, cols;
+	size_t i, n;
+	int64_t id;
+	PyObject *ids = NULL, *dists = NULL, *ret = NULL;
+	Py_buffer view;
+
+	static char *kwlist[] = {"lat", "lng", "k", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "ddn", kwlist, &lat, &lng, &k))
+		return NULL;
+	if (!gq_lat_in_range(lat) || !gq_lng_in_range(lng)) {
+		PyErr_SetString(PyExc_ValueError, "Invalid coordinates");
+		return NULL;
+	}
+	if (k < 0) {
+		PyErr_SetString(PyExc_ValueError, "k must not be negative");
+		return NULL;
+	}
+
+	h.k = ((size_t) k < index->n) ? (size_t) k : index->n;
+	h.dists = malloc(sizeof(double) * (h.k + 1));
+	h.ids = malloc(sizeof(int64_t) * (h.k + 1));
+	if (!h.dists || !h.ids) {
+		PyErr_NoMemory();
+		goto done;
+	}
+
+	/* Visit growing boxes of geoquads around the origin's, with columns
+	 * wrapping around the antimeridian. Each box is a rows either side of
+	 * the origin and b columns, with b scaled up where meridians converge so
+	 * that the boxes stay roughly round. Once the box holds k records closer
+	 * than anything outside it can be, we're done. */
+	Py_BEGIN_ALLOW_THREADS
+	x0 = gq_lat_to_half(lat);
+	y0 = gq_lng_to_half(lng);
+	x_max = gq_lat_to_half(GEOQUAD_LATITUDE_MAX);
+	cols = gq_lng_to_half(GEOQUAD_LONGITUDE_MAX) + 1;
+	for (a = 0, b_cols = 0, a_old = b_old = -1; h.k; ) {
+		w = (2 * b_cols + 1 < cols) ? 2 * b_cols + 1 : cols;
+		w_old = (2 * b_old + 1 < cols) ? 2 * b_old + 1 : cols;
+		for (x = x0 - a; x <= x0 + a; x++) {
+			if ((x < 0) || (x > x_max))
+				continue;
+			if ((x < x0 - a_old) || (x > x0 + a_old)) {
+				for (y = 0; y < w; y++)
+					knn_visit(index, &h, lat, lng, x, (y0 - b_cols + y + 2 * cols) % cols);
+			} else if (w == cols) {
+				for (y = w_old; y < cols; y++)
+					knn_visit(index, &h, lat, lng, x, (y0 - b_old + y + 2 * cols) % cols);
+			} else {
+				for (y = y0 - b_cols; y < y0 - b_old; y++)
+					knn_visit(index, &h, lat, lng, x, (y + 2 * cols) % cols);
+				for (y = y0 + b_old + 1; y <= y0 + b_cols; y++)
+					knn_visit(index, &h, lat, lng, x, (y + 2 * cols) % cols);
+			}
+		}
+
+		/* The closest anything outside the box can be, unless there's
+		 * nothing left outside it */
+		if (((x0 - a <= 0) && (x0 + a >= x_max) && (w == cols)) || (h.len == index->n))
+			break;
+		bound = HUGE_VAL;
+		if (x0 + a < x_max) {
+			edge = (x0 + a + 1) * GEOQUAD_STEP + GEOQUAD_LATITUDE_MIN - lat;
+			bound = GEOQUAD_EARTH_RADIUS_MI * TO_RADIANS(edge);
+		}
+		if (x0 - a > 0) {
+			edge = lat - ((x0 - a) * GEOQUAD_STEP + GEOQUAD_LATITUDE_MIN);
+			b = GEOQUAD_EARTH_RADIUS_MI * TO_RADIANS(edge);
+			bound = (b < bound) ? b : bound;
+		}
+		if (w < cols) {
+			b = meridian_distance(lat, lng - ((y0 - b_cols) * GEOQUAD_STEP + GEOQUAD_LONGITUDE_MIN));
+			bound = (b < bound) ? b : bound;
+			b = meridian_distance(lat, (y0 + b_cols + 1) * GEOQUAD_STEP + GEOQUAD_LONGITUDE_MIN - lng);
+			bound = (b < bound) ? b : bound;
+		}
+		if ((h.len == h.k) && (h.dists[0] <= bound))
+			break;
+
+		/* Grow the box, with columns as wide as rows are tall at the
+		 * box's poleward edge */
+		a_old = a;
+		b_old = b_cols;
+		a++;
+		edge = fabs((x0 + a + 1) * GEOQUAD_STEP + GEOQUAD_LATITUDE_MIN);
+		b = fabs((x0 - a) * GEOQUAD_STEP + GEOQUAD_LATITUDE_MIN);
+		edge = (b > edge) ? b : edge;
+		b = (edge < 89.9) ? ceil(a / cos(TO_RADIANS(edge))) : cols;
+		b_cols = (b < cols) ? (int) b : cols;
+		if (b_cols <= b_old)
+			b_cols = b_old + 1;
+	}
+
+	/* Heapsort in place, nearest first */
+	n = h.len;
+	for (i = n; i > 1; i--) {
+		b = h.dists[0];
+		h.dists[0] = h.dists[i - 1];
+		h.dists[i - 1] = b;
+		id = h.ids[0];
+		h.ids[0] = h.ids[i - 1];
+		h.ids[i - 1] = id;
+		h.len = i - 1;
+		knn_heap_sift_down(&h, 0);
+	}
+	Py_END_ALLOW_THREADS
+
+	if (!(ids = new_array('l', n)) || !(dists = new_array('d', n)))
+		goto done;
+	if (get_buffer(ids, &view, "ids", "lq", sizeof(int64_t), 1) == -1)
+		goto done;
+	memcpy(view.buf, h.ids, sizeof(int64_t) * n);
+	PyBuffer_Release(&view);
+	if (get_buffer(dists, &view, "distances", "d", sizeof(double), 1) == -1)
+		goto done;
+	memcpy(view.buf, h.dists, sizeof(double) * n);
+	PyBuffer_Release(&view);
+	ret = Py_BuildValue("(OO)", ids, dists);
+
+done:
+	Py_XDECREF(ids);
+	Py_XDECREF(dists);
+	free(h.dists);
+	free(h.ids);
+	return ret;
+}
+
+/* GeoIndex files hold the arrays of an index as they are in memory, so a
+ * loaded index can point straight into a shared read only mapping of the
+ * file. After the header come the keys, offsets, ids, lats and lngs
+ * sections, each starting on a 64 byte boundary. Files are only readable on
+ * machines with the same byte order as the one that wrote them. */
+
+#define GEOINDEX_MAGIC    "GEOQIDX"
+#define GEOINDEX_VERSION  1
+#define GEOINDEX_BOM      0x01020304
+#define GEOINDEX_ALIGN    64
+
+typedef struct {
+	char magic[8];        /* GEOINDEX_MAGIC, NUL padded */
+	uint32_t version;
+	uint32_t byte_order;  /* GEOINDEX_BOM as written */
+	uint64_t n;
+	uint64_t nkeys;
+	uint64_t sections[5]; /* file offsets of keys, offsets, ids, lats, lngs */
+	uint64_t size;        /* of the whole file */
+} geoindex_header;
+
+#define GEOINDEX_ALIGN_UP(x) (((x) + GEOINDEX_ALIGN - 1) & ~(uint64_t) (GEOINDEX_ALIGN - 1))
+
+/* Lays out the sections of an index of @n records and @nkeys keys in
+ * @header */
+static void
+geoindex_layout(geoindex_header *header, uint64_t n, uint64_t nkeys)
+{
+	uint64_t sizes[5], pos;
+	int i;
+
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, GEOINDEX_MAGIC, sizeof(GEOINDEX_MAGIC));
+	header->version = GEOINDEX_VERSION;
+	header->byte_order = GEOINDEX_BOM;
+	header->n = n;
+	header->nkeys = nkeys;
+
+	sizes[0] = sizeof(uint32_t) * nkeys;
+	sizes[1] = sizeof(uint64_t) * (nkeys + 1);
+	sizes[2] = sizeof(int64_t) * n;
+	sizes[3] = sizeof(double) * n;
+	sizes[4] = sizeof(double) * n;
+	pos = GEOINDEX_ALIGN_UP(sizeof(geoindex_header));
+	for (i = 0; i < 5; i++) {
+		header->sections[i] = pos;
+		pos = GEOINDEX_ALIGN_UP(pos + sizes[i]);
+	}
+	header->size = pos;
+}
+
+/* Whether the keys and offsets of the mapped index file @map are usable:
+ * the keys strictly increasing and the offsets nondecreasing from 0 to n,
+ * which keeps every record range within the columns. */
+static int
+geoindex_check(const geoindex_header *header, const void *map)
+{
+	const uint32_t *keys = (const uint32_t *) ((const char *) map + header->sections[0]);
+	const uint64_t *offsets = (const uint64_t *) ((const char *) map + header->sections[1]);
+	uint64_t i;
+
+	if ((offsets[0] != 0) || (offsets[header->nkeys] != header->n))
+		return 0;
+	for (i = 0; i < header->nkeys; i++) {
+		if (offsets[i] > offsets[i + 1])
+			return 0;
+		if ((i > 0) && (keys[i - 1] >= keys[i]))
+			return 0;
+	}
+	return 1;
+}
+
+static PyObject*
+geoindex_save(GeoIndexObject *index, PyObject *args)
+{
+	const char *path;
+	geoindex_header header;
+	const void *sections[5];
+	size_t sizes[5];
+	static const char zeros[GEOINDEX_ALIGN];
+	uint64_t pos;
+	struct stat st;
+	char *tmp;
+	FILE *f = NULL;
+	int i, fd = -1, attempt, saved_errno, err = 0;
+
+	if (!PyArg_ParseTuple(args, "s", &path))
+		return NULL;
+	if (!(tmp = PyMem_Malloc(strlen(path) + 64)))
+		return PyErr_NoMemory();
+
+	geoindex_layout(&header, index->n, index->nkeys);
+	sections[0] = index->keys;
+	sections[1] = index->offsets;
+	sections[2] = index->ids;
+	sections[3] = index->lats;
+	sections[4] = index->lngs;
+	sizes[0] = sizeof(uint32_t) * index->nkeys;
+	sizes[1] = sizeof(uint64_t) * (index->nkeys + 1);
+	sizes[2] = sizeof(int64_t) * index->n;
+	sizes[3] = sizes[4] = sizeof(double) * index->n;
+
+	/* The index is written to a new file next to @path and renamed over it,
+	 * so processes that have the old file mapped keep their (complete) copy
+	 * and a crash part way through never leaves a partial index behind. */
+	Py_BEGIN_ALLOW_THREADS
+	for (attempt = 0; attempt < 100; attempt++) {
+		sprintf(tmp, "%s.tmp%ld.%d", path, (long) getpid(), attempt);
+		if (((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666)) != -1) || (errno != EEXIST))
+			break;
+	}
+	if ((fd != -1) && !(f = fdopen(fd, "wb"))) {
+		saved_errno = errno;
+		close(fd);
+		unlink(tmp);
+		errno = saved_errno;
+	}
+	if (f) {
+		/* Keep the permissions of the file being replaced */
+		if (!stat(path, &st))
+			fchmod(fd, st.st_mode & 07777);
+		err = fwrite(&header, sizeof(header), 1, f) != 1;
+		pos = sizeof(header);
+		for (i = 0; (i < 5) && !err; i++) {
+			err = (fwrite(zeros, 1, header.sections[i] - pos, f) != header.sections[i] - pos) ||
+			      (sizes[i] && (fwrite(sections[i], sizes[i], 1, f) != 1));
+			pos = header.sections[i] + sizes[i];
+		}
+		if (!err)
+			err = fwrite(zeros, 1, header.size - pos, f) != header.size - pos;
+		if (!err)
+			err = fflush(f) || fsync(fd);
+		if (fclose(f))
+			err = 1;
+		if (!err)
+			err = rename(tmp, path) != 0;
+		if (err) {
+			saved_errno = errno;
+			unlink(tmp);
+			errno = saved_errno;
+		}
+	} else {
+		err = 1;
+	}
+	Py_END_ALLOW_THREADS
+
+	PyMem_Free(tmp);
+	if (err)
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) path);
+	Py_RETURN_NONE;
+}
+
+static PyObject*
+geoindex_load(PyTypeObject *type, PyObject *args)
+{
+	const char *path;
+	geoindex_header header, expected;
+	GeoIndexObject *index;
+	struct stat st;
+	void *map = MAP_FAILED;
+	int fd, too_small = 0, bad;
+
+	if (!PyArg_ParseTuple(args, "s", &path))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	if ((fd = open(path, O_RDONLY)) != -1) {
+		if (!fstat(fd, &st)) {
+			too_small = st.st_size < (off_t) sizeof(header);
+			if (!too_small)
+				map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+	}
+	Py_END_ALLOW_THREADS
+
+	if (too_small) {
+		PyErr_Format(PyExc_ValueError, "%s is not a geoquad index", path);
+		return NULL;
+	}
+	if (map == MAP_FAILED)
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *) path);
+
+	/* The layout is entirely determined by the counts, so anything that
+	 * doesn't match what we'd have written is rejected */
+	memcpy(&header, map, sizeof(header));
+	if (memcmp(header.magic, GEOINDEX_MAGIC, sizeof(GEOINDEX_MAGIC))) {
+		PyErr_Format(PyExc_ValueError, "%s is not a geoquad index", path);
+		goto error;
+	}
+	if (header.version != GEOINDEX_VERSION) {
+		PyErr_Format(PyExc_ValueError, "%s has unsupported version %u", path, header.version);
+		goto error;
+	}
+	if (header.byte_order != GEOINDEX_BOM) {
+		PyErr_Format(PyExc_ValueError, "%s was written with a different byte order", path);
+		goto error;
+	}
+	geoindex_layout(&expected, header.n, header.nkeys);
+	if ((header.nkeys > header.n) || (header.n > UINT32_MAX) || memcmp(&header, &expected, sizeof(header)) ||
+	    ((uint64_t) st.st_size != header.size)) {
+		PyErr_Format(PyExc_ValueError, "%s is corrupt", path);
+		goto error;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	bad = !geoindex_check(&header, map);
+	Py_END_ALLOW_THREADS
+	if (bad) {
+		PyErr_Format(PyExc_ValueError, "%s is corrupt", path);
+		goto error;
+	}
+
+	if (!(index = (GeoIndexObject *) type->tp_alloc(type, 0)))
+		goto error;
+	index->map = map;
+	index->map_size = st.st_size;
+	index->n = header.n;
+	index->nkeys = header.nkeys;
+	index->keys = (uint32_t *) ((char *) map + header.sections[0]);
+	index->offsets = (uint64_t *) ((char *) map + header.sections[1]);
+	index->ids = (int64_t *) ((char *) map + header.sections[2]);
+	index->lats = (double *) ((char *) map + header.sections[3]);
+	index->lngs = (double *) ((char *) map + header.sections[4]);
+	return (PyObject *) index;
+
+error:
+	munmap(map, st.st_size);
+	return NULL;
+}
+
+static PyMethodDef geoindex_methods[] = {
+	{ "query_radius", (PyCFunction) geoindex_query_radius, METH_VARARGS|METH_KEYWORDS, "ids of the records within radius miles of (lat, lng)" },
+	{ "knn", (PyCFunction) geoindex_knn, METH_VARARGS|METH_KEYWORDS, "(ids, distances) of the k records nearest (lat, lng), nearest first" },
+	{ "save", (PyCFunction) geoindex_save, METH_VARARGS, "writes the index to a file for GeoIndex.load" },
+	{ "load", (PyCFunction) geoindex_load, METH_VARARGS|METH_CLASS, "maps an index written by save, sharing its pages between processes" },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PySequenceMethods geoindex_as_sequence = {
+	(lenfunc) geoindex_length,  /* sq_length */
+};
+
+static PyTypeObject GeoIndexType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"geoquad.GeoIndex",                /* tp_name */
+	sizeof(GeoIndexObject),            /* tp_basicsize */
+	0,                                 /* tp_itemsize */
+	(destructor) geoindex_dealloc,     /* tp_dealloc */
+	0,                                 /* tp_print */
+	0,                                 /* tp_getattr */
+	0,                                 /* tp_setattr */
+	0,                                 /* tp_compare */
+	0,                                 /* tp_repr */
+	0,                                 /* tp_as_number */
+	&geoindex_as_sequence,             /* tp_as_sequence */
+	0,                                 /* tp_as_mapping */
+	0,                                 /* tp_hash */
+	0,                                 /* tp_call */
+	0,                                 /* tp_str */
+	0,                                 /* tp_getattro */
+	0,                                 /* tp_setattro */
+	0,                                 /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,                /* tp_flags */
+	"GeoIndex(ids, lats, lngs, threads=0): a static index of points by geoquad", /* tp_doc */
+	0,                                 /* tp_traverse */
+	0,                                 /* tp_clear */
+	0,                                 /* tp_richcompare */
+	0,                                 /* tp_weaklistoffset */
+	0,                                 /* tp_iter */
+	0,                                 /* tp_iternext */
+	geoindex_methods,                  /* tp_methods */
+	0,                                 /* tp_members */
+	0,                                 /* tp_getset */
+	0,                                 /* tp_base */
+	0,                                 /* tp_dict */
+	0,                                 /* tp_descr_get */
+	0,                                 /* tp_descr_set */
+	0,                                 /* tp_dictoffset */
+	0,                                 /* tp_init */
+	0,                                 /* tp_alloc */
+	geoindex_new,                      /* tp_new */
+};
+
+/***************************
+ * DYNAMIC GEO INDEX
+ *
+ * A mutable index of (id, lat, lng) records for concurrent updates. Records
+ * are split into DYN_SHARDS spatial shards by the high bits of their
+ * geoquad, each with its own rwlock, records array and hash table from
+ * geoquad to a linked list of that cell's records. Records don't move within
+ * a shard's array (freed slots are reused), so a separate directory, sharded
+ * by id with a mutex per shard, can map ids to their geoquad and slot.
+ * Updates lock the id's directory shard and then the spatial shards
+ * involved (in shard order when a record moves between two), so updates of
+ * different ids only contend when they touch the same shards, and a query
+ * sees each spatial shard as of one moment.
+ *
+ * Everything here runs without the GIL, so memory comes from malloc rather
+ * than PyMem_Malloc.
+ **************************/
+
+#define DYN_SHARD_SHIFT  12  /* 64x64 geoquads per shard */
+#define DYN_SHARDS       (1 << (26 - DYN_SHARD_SHIFT))
+#define DYN_DIR_SHARDS   256
+#define DYN_NONE         UINT32_MAX
+#define DYN_EMPTY        UINT64_MAX
+
+/* An open addressing hash table from 64 bit keys to 64 bit values, which
+ * can't be DYN_EMPTY. Deletion shifts entries back rather than leaving
+ * tombstones. */
+typedef struct {
+	uint64_t *keys;
+	uint64_t *vals;
+	size_t cap;  /* a power of two, or 0 */
+	size_t len;
+} dyn_map;
+
+static inline size_t
+dyn_map_slot(const dyn_map *m, uint64_t key)
+{
+	return (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (m->cap - 1);
+}
+
+static uint64_t
+dyn_map_get(const dyn_map *m, uint64_t key)
+{
+	size_t i;
+
+	if (!m->cap)
+		return DYN_EMPTY;
+	for (i = dyn_map_slot(m, key); m->vals[i] != DYN_EMPTY; i = (i + 1) & (m->cap - 1))
+		if (m->keys[i] == key)
+			return m->vals[i];
+	return DYN_EMPTY;
+}
+
+/* Makes room for one more entry. Returns -1 if out of memory. */
+static int
+dyn_map_reserve(dyn_map *m)
+{
+	dyn_map grown;
+	size_t i, j;
+
+	if (2 * (m->len + 1) <= m->cap)
+		return 0;
+	grown.cap = m->cap ? 2 * m->cap : 16;
+	grown.len = m->len;
+	grown.keys = malloc(sizeof(uint64_t) * grown.cap);
+	grown.vals = malloc(sizeof(uint64_t) * grown.cap);
+	if (!grown.keys || !grown.vals) {
+		free(grown.keys);
+		free(grown.vals);
+		return -1;
+	}
+	memset(grown.vals, 0xFF, sizeof(uint64_t) * grown.cap);
+	for (i = 0; i < m->cap; i++) {
+		if (m->vals[i] == DYN_EMPTY)
+			continue;
+		for (j = dyn_map_slot(&grown, m->keys[i]); grown.vals[j] != DYN_EMPTY; j = (j + 1) & (grown.cap - 1))
+			;
+		grown.keys[j] = m->keys[i];
+		grown.vals[j] = m->vals[i];
+	}
+	free(m->keys);
+	free(m->vals);
+	*m = grown;
+	return 0;
+}
+
+/* Sets @key to @val. There must be room (see dyn_map_reserve). */
+static void
+dyn_map_put(dyn_map *m, uint64_t key, uint64_t val)
+{
+	size_t i;
+
+	for (i = dyn_map_slot(m, key); m->vals[i] != DYN_EMPTY; i = (i + 1) & (m->cap - 1)) {
+		if (m->keys[i] == key) {
+			m->vals[i] = val;
+			return;
+		}
+	}
+	m->keys[i] = key;
+	m->vals[i] = val;
+	m->len++;
+}
+
+static void
+dyn_map_del(dyn_map *m, uint64_t key)
+{
+	size_t i, j, home;
+
+	if (!m->cap)
+		return;
+	for (i = dyn_map_slot(m, key); m->vals[i] != DYN_EMPTY; i = (i + 1) & (m->cap - 1))
+		if (m->keys[i] == key)
+			break;
+	if (m->vals[i] == DYN_EMPTY)
+		return;
+
+	/* Shift back any following entries that the hole would cut off from
+	 * their home slot */
+	for (j = (i + 1) & (m->cap - 1); m->vals[j] != DYN_EMPTY; j = (j + 1) & (m->cap - 1)) {
+		home = dyn_map_slot(m, m->keys[j]);
+		if (((j - home) & (m->cap - 1)) >= ((j - i) & (m->cap - 1))) {
+			m->keys[i] = m->keys[j];
+			m->vals[i] = m->vals[j];
+			i = j;
+		}
+	}
+	m->vals[i] = DYN_EMPTY;
+	m->len--;
+}
+
+typedef struct {
+	int64_t id;
+	double lat, lng;
+	uint32_t z;           /* DYN_NONE if the slot is free */
+	uint32_t prev, next;  /* within the cell's list, or the free list */
+} dyn_record;
+
+typedef struct {
+	pthread_rwlock_t lock;
+	dyn_record *recs;
+	size_t len;           /* live records */
+	size_t used, cap;     /* slots */
+	uint32_t free;        /* first free slot */
+	dyn_map cells;        /* geoquad to the first record in it */
+} dyn_shard;
+
+typedef struct {
+	pthread_mutex_t lock;
+	dyn_map ids;          /* id to geoquad << 32 | slot */
+} dyn_dir;
+
+typedef struct {
+	PyObject_HEAD
+	dyn_shard *shards;
+	dyn_dir *dirs;
+	size_t n;             /* updated atomically */
+} DynamicGeoIndexObject;
+
+static inline dyn_shard*
+dyn_shard_of(DynamicGeoIndexObject *index, uint32_t z)
+{
+	return &index->shards[z >> DYN_SHARD_SHIFT];
+}
+
+static inline dyn_dir*
+dyn_dir_of(DynamicGeoIndexObject *index, int64_t id)
+{
+	return &index->dirs[((uint64_t) id * 0x9E3779B97F4A7C15ULL) >> 56];
+}
+
+/* Makes room for one more record in @s. Returns -1 if out of memory. */
+static int
+dyn_shard_reserve(dyn_shard *s)
+{
+	dyn_record *grown;
+	size_t cap;
+
+	if (dyn_map_reserve(&s->cells) == -1)
+		return -1;
+	if ((s->free != DYN_NONE) || (s->used < s->cap))
+		return 0;
+	cap = s->cap ? 2 * s->cap : 16;
+	if (!(grown = realloc(s->recs, sizeof(dyn_record) * cap)))
+		return -1;
+	s->recs = grown;
+	s->cap = cap;
+	return 0;
+}
+
+/* Links slot @r into the list of cell @z of @s */
+static void
+dyn_shard_link(dyn_shard *s, uint32_t r, uint32_t z)
+{
+	uint64_t head = dyn_map_get(&s->cells, z);
+	dyn_record *rec = &s->recs[r];
+
+	rec->z = z;
+	rec->prev = DYN_NONE;
+	rec->next = (head == DYN_EMPTY) ? DYN_NONE : (uint32_t) head;
+	if (rec->next != DYN_NONE)
+		s->recs[rec->next].prev = r;
+	dyn_map_put(&s->cells, z, r);
+}
+
+/* Unlinks slot @r from its cell's list */
+static void
+dyn_shard_unlink(dyn_shard *s, uint32_t r)
+{
+	dyn_record *rec = &s->recs[r];
+
+	if (rec->prev != DYN_NONE)
+		s->recs[rec->prev].next = rec->next;
+	else if (rec->next != DYN_NONE)
+		dyn_map_put(&s->cells, rec->z, rec->next);
+	else
+		dyn_map_del(&s->cells, rec->z);
+	if (rec->next != DYN_NONE)
+		s->recs[rec->next].prev = rec->prev;
+}
+
+/* Adds a record to @s, which must have room for it, and returns its slot */
+static uint32_t
+dyn_shard_add(dyn_shard *s, int64_t id, double lat, double lng, uint32_t z)
+{
+	uint32_t r;
+
+	if (s->free != DYN_NONE) {
+		r = s->free;
+		s->free = s->recs[r].next;
+	} else {
+		r = (uint32_t) s->used++;
+	}
+	s->recs[r].id = id;
+	s->recs[r].lat = lat;
+	s->recs[r].lng = lng;
+	dyn_shard_link(s, r, z);
+	s->len++;
+	return r;
+}
+
+static void
+dyn_shard_remove(dyn_shard *s, uint32_t r)
+{
+	dyn_shard_unlink(s, r);
+	s->recs[r].z = DYN_NONE;
+	s->recs[r].next = s->free;
+	s->free = r;
+	s->len--;
+}
+
+static PyObject*
+dyngeoindex_new(PyTypeObject *type, PyObject *args, PyObject *kw)
+{
+	DynamicGeoIndexObject *index;
+	size_t i;
+
+	static char *kwlist[] = {NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "", kwlist))
+		return NULL;
+	if (!(index = (DynamicGeoIndexObject *) type->tp_alloc(type, 0)))
+		return NULL;
+	index->shards = calloc(DYN_SHARDS, sizeof(dyn_shard));
+	index->dirs = calloc(DYN_DIR_SHARDS, sizeof(dyn_dir));
+	if (!index->shards || !index->dirs) {
+		free(index->shards);
+		free(index->dirs);
+		index->shards = NULL;
+		index->dirs = NULL;
+		Py_DECREF(index);
+		return PyErr_NoMemory();
+	}
+	for (i = 0; i < DYN_SHARDS; i++) {
+		pthread_rwlock_init(&index->shards[i].lock, NULL);
+		index->shards[i].free = DYN_NONE;
+	}
+	for (i = 0; i < DYN_DIR_SHARDS; i++)
+		pthread_mutex_init(&index->dirs[i].lock, NULL);
+	return (PyObject *) index;
+}
+
+static void
+dyngeoindex_dealloc(DynamicGeoIndexObject *index)
+{
+	size_t i;
+
+	if (index->shards) {
+		for (i = 0; i < DYN_SHARDS; i++) {
+			pthread_rwlock_destroy(&index->shards[i].lock);
+			free(index->shards[i].recs);
+			free(index->shards[i].cells.keys);
+			free(index->shards[i].cells.vals);
+		}
+		for (i = 0; i < DYN_DIR_SHARDS; i++) {
+			pthread_mutex_destroy(&index->dirs[i].lock);
+			free(index->dirs[i].ids.keys);
+			free(index->dirs[i].ids.vals);
+		}
+	}
+	free(index->shards);
+	free(index->dirs);
+	Py_TYPE(index)->tp_free((PyObject *) index);
+}
+
+static Py_ssize_t
+dyngeoindex_length(DynamicGeoIndexObject *index)
+{
+	return (Py_ssize_t) __sync_fetch_and_add(&index->n, 0);
+}
+
+/* Inserts or moves record @id. Returns -1 if out of memory, in which case
+ * the index is unchanged. */
+static int
+dyn_upsert(DynamicGeoIndexObject *index, int64_t id, double lat, double lng)
+{
+	uint32_t z = gq_interleave_full(gq_lat_to_half(lat), gq_lng_to_half(lng)), old_z, r;
+	dyn_dir *dir = dyn_dir_of(index, id);
+	dyn_shard *from, *to = dyn_shard_of(index, z);
+	uint64_t entry;
+	int err = 0;
+
+	pthread_mutex_lock(&dir->lock);
+	if ((entry = dyn_map_get(&dir->ids, (uint64_t) id)) == DYN_EMPTY) {
+		if (dyn_map_reserve(&dir->ids) == -1) {
+			err = -1;
+		} else {
+			pthread_rwlock_wrlock(&to->lock);
+			if (!(err = dyn_shard_reserve(to)))
+				r = dyn_shard_add(to, id, lat, lng, z);
+			pthread_rwlock_unlock(&to->lock);
+			if (!err) {
+				dyn_map_put(&dir->ids, (uint64_t) id, ((uint64_t) z << 32) | r);
+				__sync_fetch_and_add(&index->n, 1);
+			}
+		}
+		pthread_mutex_unlock(&dir->lock);
+		return err;
+	}
+
+	old_z = (uint32_t) (entry >> 32);
+	r = (uint32_t) entry;
+	from = dyn_shard_of(index, old_z);
+	if (from == to) {
+		/* Moving within a shard keeps the slot */
+		pthread_rwlock_wrlock(&to->lock);
+		if ((old_z == z) || !(err = dyn_map_reserve(&to->cells))) {
+			to->recs[r].lat = lat;
+			to->recs[r].lng = lng;
+			if (old_z != z) {
+				dyn_shard_unlink(to, r);
+				dyn_shard_link(to, r, z);
+			}
+		}
+		pthread_rwlock_unlock(&to->lock);
+	} else {
+		/* Both shards are locked, in a fixed order, so that a reader
+		 * of either shard finds the record in exactly one of them. A
+		 * query visits the shards one at a time though, so it can see
+		 * the record in both (see dyngeoindex_query_radius). */
+		pthread_rwlock_wrlock((from < to) ? &from->lock : &to->lock);
+		pthread_rwlock_wrlock((from < to) ? &to->lock : &from->lock);
+		if (!(err = dyn_shard_reserve(to))) {
+			dyn_shard_remove(from, r);
+			r = dyn_shard_add(to, id, lat, lng, z);
+		}
+		pthread_rwlock_unlock(&to->lock);
+		pthread_rwlock_unlock(&from->lock);
+	}
+	if (!err)
+		dyn_map_put(&dir->ids, (uint64_t) id, ((uint64_t) z << 32) | r);
+	pthread_mutex_unlock(&dir->lock);
+	return err;
+}
+
+static PyObject*
+dyngeoindex_insert(DynamicGeoIndexObject *index, PyObject *args, PyObject *kw)
+{
+	PY_LONG_LONG id;
+	double lat, lng;
+	int err;
+
+	static char *kwlist[] = {"id", "lat", "lng", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "Ldd", kwlist, &id, &lat, &lng))
+		return NULL;
+	if (!gq_lat_in_range(lat) || !gq_lng_in_range(lng)) {
+		PyErr_SetString(PyExc_ValueError, "Invalid coordinates");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	err = dyn_upsert(index, (int64_t) id, lat, lng);
+	Py_END_ALLOW_THREADS
+
+	if (err)
+		return PyErr_NoMemory();
+	Py_RETURN_NONE;
+}
+
+static PyObject*
+dyngeoindex_delete(DynamicGeoIndexObject *index, PyObject *args, PyObject *kw)
+{
+	PY_LONG_LONG id;
+	uint64_t entry;
+	dyn_dir *dir;
+	dyn_shard *s;
+
+	static char *kwlist[] = {"id", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "L", kwlist, &id))
+		return NULL;
+
+	dir = dyn_dir_of(index, (int64_t) id);
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&dir->lock);
+	if ((entry = dyn_map_get(&dir->ids, (uint64_t) id)) != DYN_EMPTY) {
+		s = dyn_shard_of(index, (uint32_t) (entry >> 32));
+		pthread_rwlock_wrlock(&s->lock);
+		dyn_shard_remove(s, (uint32_t) entry);
+		pthread_rwlock_unlock(&s->lock);
+		dyn_map_del(&dir->ids, (uint64_t) id);
+		__sync_fetch_and_sub(&index->n, 1);
+	}
+	pthread_mutex_unlock(&dir->lock);
+	Py_END_ALLOW_THREADS
+
+	return PyBool_FromLong(entry != DYN_EMPTY);
+}
+
+/* Appends @rec's id to @found if it's within @radius of (@lat, @lng).
+ * Returns -1 if out of memory. */
+static int
+dyn_found_add(const dyn_record *rec, double lat, double lng, double radius, int64_t **found, size_t *nfound, size_t *alloc)
+{
+	int64_t *grown;
+
+	if (gq_haversine_distance(lat, lng, rec->lat, rec->lng) > radius)
+		return 0;
+	if (*nfound == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 64;
+		if (!(grown = realloc(*found, sizeof(int64_t) * *alloc)))
+			return -1;
+		*found = grown;
+	}
+	(*found)[(*nfound)++] = rec->id;
+	return 0;
+}
+
+/* Appends the records of shard @s, which must be locked, that are within
+ * @radius of (@lat, @lng) and in one of the @m sorted @ranges to @found. The
+ * cell table is probed for each geoquad of the ranges, unless there are more
+ * of those than records in the shard, when the records are scanned instead.
+ * Returns -1 if out of memory. */
+static int
+dyn_shard_query(const dyn_shard *s, const uint32_t *ranges, size_t m, double lat, double lng, double radius,
+	int64_t **found, size_t *nfound, size_t *alloc)
+{
+	size_t i, cells = 0, lo, hi, mid;
+	uint64_t r;
+	uint32_t z;
+
+	for (i = 0; i < m; i++)
+		cells += (size_t) (ranges[2 * i + 1] - ranges[2 * i]) + 1;
+
+	if (cells > s->len) {
+		for (i = 0; i < s->used; i++) {
+			if (s->recs[i].z == DYN_NONE)
+				continue;
+			for (lo = 0, hi = m; lo < hi; ) {
+				mid = (lo + hi) >> 1;
+				if (ranges[2 * mid + 1] < s->recs[i].z)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			if ((lo < m) && (s->recs[i].z >= ranges[2 * lo]) &&
+			    (dyn_found_add(&s->recs[i], lat, lng, radius, found, nfound, alloc) == -1))
+				return -1;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < m; i++) {
+		for (z = ranges[2 * i]; ; z++) {
+			for (r = dyn_map_get(&s->cells, z); (r != DYN_EMPTY) && (r != DYN_NONE); r = s->recs[r].next)
+				if (dyn_found_add(&s->recs[r], lat, lng, radius, found, nfound, alloc) == -1)
+					return -1;
+			if (z == ranges[2 * i + 1])
+				break;
+		}
+	}
+	return 0;
+}
+
+static int
+compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+	return (x > y) - (x < y);
+}
+
+static PyObject*
+dyngeoindex_query_radius(DynamicGeoIndexObject *index, PyObject *args, PyObject *kw)
+{
+	double lat, lng, radius;
+	range_list rl = {NULL, 0, 0}, split = {NULL, 0, 0};
+	int64_t *found = NULL;
+	size_t i, j, nfound = 0, alloc = 0;
+	uint32_t lo, hi, end;
+	dyn_shard *s;
+	int err = 0;
+	PyObject *ret = NULL;
+
+	static char *kwlist[] = {"lat", "lng", "radius", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "ddd", kwlist, &lat, &lng, &radius))
+		return NULL;
+	if (!gq_lat_in_range(lat) || !gq_lng_in_range(lng)) {
+		PyErr_SetString(PyExc_ValueError, "Invalid coordinates");
+		return NULL;
+	}
+	if (!(radius >= 0)) {
+		PyErr_SetString(PyExc_ValueError, "radius must be a nonnegative number");
+		return NULL;
+	}
+
+	/* Cut the cover's ranges at shard boundaries, so that each shard's
+	 * ranges can be scanned under one lock */
+	if (radius_ranges(lat, lng, radius, &rl) == -1) {
+		PyErr_NoMemory();
+		goto done;
+	}
+	for (i = 0; i < rl.len; i++)
+		split.alloc += (rl.ranges[2 * i + 1] >> DYN_SHARD_SHIFT) - (rl.ranges[2 * i] >> DYN_SHARD_SHIFT) + 1;
+	if (!(split.ranges = PyMem_Malloc(sizeof(uint32_t) * 2 * (split.alloc + 1)))) {
+		PyErr_NoMemory();
+		goto done;
+	}
+	for (i = 0; i < rl.len; i++) {
+		for (lo = rl.ranges[2 * i], hi = rl.ranges[2 * i + 1]; ; lo = end + 1) {
+			end = lo | ((1u << DYN_SHARD_SHIFT) - 1);
+			split.ranges[2 * split.len] = lo;
+			split.ranges[2 * split.len++ + 1] = (end < hi) ? end : hi;
+			if (end >= hi)
+				break;
+		}
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	for (i = 0; (i < split.len) && !err; i = j) {
+		s = dyn_shard_of(index, split.ranges[2 * i]);
+		for (j = i + 1; (j < split.len) && (dyn_shard_of(index, split.ranges[2 * j]) == s); j++)
+			;
+		pthread_rwlock_rdlock(&s->lock);
+		if (s->len)
+			err = dyn_shard_query(s, &split.ranges[2 * i], j - i, lat, lng, radius, &found, &nfound, &alloc);
+		pthread_rwlock_unlock(&s->lock);
+	}
+
+	/* A record moved from a shard that hasn't been visited yet to one that
+	 * has is missed, which is fine (it moved during the query), but one
+	 * moved the other way is found twice, so drop the duplicates */
+	if (!err && (nfound > 1)) {
+		qsort(found, nfound, sizeof(int64_t), compare_int64);
+		for (i = 1, j = 1; i < nfound; i++)
+			if (found[i] != found[j - 1])
+				found[j++] = found[i];
+		nfound = j;
+	}
+	Py_END_ALLOW_THREADS
+
+	if (err)
+		PyErr_NoMemory();
+	else
+		ret = ids_to_array(found, nfound);
+
+done:
+	free(found);
+	free(rl.ranges);
+	PyMem_Free(split.ranges);
+	return ret;
+}
+
+static PyMethodDef dyngeoindex_methods[] = {
+	{ "insert", (PyCFunction) dyngeoindex_insert, METH_VARARGS|METH_KEYWORDS, "adds record id at (lat, lng), or moves it there" },
+	{ "delete", (PyCFunction) dyngeoindex_delete, METH_VARARGS|METH_KEYWORDS, "removes record id, returning whether it was there" },
+	{ "query_radius", (PyCFunction) dyngeoindex_query_radius, METH_VARARGS|METH_KEYWORDS, "sorted ids of the records within radius miles of (lat, lng)" },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PySequenceMethods dyngeoindex_as_sequence = {
+	(lenfunc) dyngeoindex_length,  /* sq_length */
+};
+
+static PyTypeObject DynamicGeoIndexType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"geoquad.DynamicGeoIndex",         /* tp_name */
+	sizeof(DynamicGeoIndexObject),     /* tp_basicsize */
+	0,                                 /* tp_itemsize */
+	(destructor) dyngeoindex_dealloc,  /* tp_dealloc */
+	0,                                 /* tp_print */
+	0,                                 /* tp_getattr */
+	0,                                 /* tp_setattr */
+	0,                                 /* tp_compare */
+	0,                                 /* tp_repr */
+	0,                                 /* tp_as_number */
+	&dyngeoindex_as_sequence,          /* tp_as_sequence */
+	0,                                 /* tp_as_mapping */
+	0,                                 /* tp_hash */
+	0,                                 /* tp_call */
+	0,                                 /* tp_str */
+	0,                                 /* tp_getattro */
+	0,                                 /* tp_setattro */
+	0,                                 /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,                /* tp_flags */
+	"DynamicGeoIndex(): a mutable index of points by geoquad, safe to update from many threads", /* tp_doc */
+	0,                                 /* tp_traverse */
+	0,                                 /* tp_clear */
+	0,                                 /* tp_richcompare */
+	0,                                 /* tp_weaklistoffset */
+	0,                                 /* tp_iter */
+	0,                                 /* tp_iternext */
+	dyngeoindex_methods,               /* tp_methods */
+	0,                                 /* tp_members */
+	0,                                 /* tp_getset */
+	0,                                 /* tp_base */
+	0,                                 /* tp_dict */
+	0,                                 /* tp_descr_get */
+	0,                                 /* tp_descr_set */
+	0,                                 /* tp_dictoffset */
+	0,                                 /* tp_init */
+	0,                                 /* tp_alloc */
+	dyngeoindex_new,                   /* tp_new */
+};
+
+static PyObject*
+geoquad_set_nearby_cache(PyObject *self, PyObject *args)
+{
+	int enable;
+
+	if (!PyArg_ParseTuple(args, "i", &enable))
+		return NULL;
+
+	return PyBool_FromLong(gq_set_nearby_cache(enable));
+}
+
+static PyObject*
+geoquad_set_bmi2(PyObject *self, PyObject *args)
+{
+	int enable, prev = 0;
+
+	if (!PyArg_ParseTuple(args, "i", &enable))
+		return NULL;
+
+#ifdef GEOQUAD_BMI2
+	if (enable && !gq_have_bmi2) {
+		PyErr_SetString(PyExc_ValueError, "BMI2 is not supported by this CPU");
+		return NULL;
+	}
+	prev = gq_use_bmi2;
+	gq_use_bmi2 = enable ? 1 : 0;
+#else
+	if (enable) {
+		PyErr_SetString(PyExc_ValueError, "BMI2 is not supported by this build");
+		return NULL;
+	}
+#endif
+	return PyBool_FromLong(prev);
+}
+
+static PyObject*
+geoquad_set_num_threads(PyObject *self, PyObject *args)
+{
+	int n, prev = pool.size;
+
+	if (!PyArg_ParseTuple(args, "i", &n))
+		return NULL;
+	if (n < 0) {
+		PyErr_SetString(PyExc_ValueError, "Number of threads must not be negative");
+		return NULL;
+	}
+
+	/* Waits for any batch running in another thread */
+	Py_BEGIN_ALLOW_THREADS
+	pool_resize(n);
+	Py_END_ALLOW_THREADS
+	return PyInt_FromLong(prev);
+}
+
+static PyObject*
+geoquad_get_num_threads(PyObject *self, PyObject *noargs)
+{
+	return PyInt_FromLong(pool.size);
+}
+
+static PyMethodDef geoquad_methods[] = {
+	{ "create", (PyCFunction) geoquad_create, METH_VARARGS, "create a geoquad from a (lat, lng)" },
+	{ "create_many", (PyCFunction) geoquad_create_many, METH_VARARGS|METH_KEYWORDS, "create geoquads from buffers of lats and lngs, returns (geoquads, error mask)" },
+	{ "parse", (PyCFunction) geoquad_parse, METH_VARARGS, "SW corner of a geoquad, returns a (lat, lng)" },
+	{ "center", (PyCFunction) geoquad_center, METH_VARARGS, "center of a geoquad, returns a (lat, lng)" },
+	{ "parse_many", (PyCFunction) geoquad_parse_many, METH_VARARGS|METH_KEYWORDS, "SW corners of a buffer of geoquads, returns (lats, lngs)" },
+	{ "center_many", (PyCFunction) geoquad_center_many, METH_VARARGS|METH_KEYWORDS, "centers of a buffer of geoquads, returns (lats, lngs)" },
+	{ "contains", (PyCFunction) geoquad_contains, METH_VARARGS, "whether or not a geoquad contaings a lng, lat" },
+	{ "northof", (PyCFunction) geoquad_northof, METH_VARARGS, "returns the geoquad directly north of a given geoquad" },
+	{ "southof", (PyCFunction) geoquad_southof, METH_VARARGS, "returns the geoquad directly south of a given geoquad" },
+	{ "eastof", (PyCFunction) geoquad_eastof, METH_VARARGS, "returns the geoquad directly east of a given geoquad" },
+	{ "westof", (PyCFunction) geoquad_westof, METH_VARARGS, "returns the geoquad directly west of a given geoquad" },
+	{ "nearby", (PyCFunction) geoquad_nearby, METH_VARARGS|METH_KEYWORDS, "get nearby geoquads, returns a list of geoquads (or fills out and returns the count)" },
+	{ "nearby_count", (PyCFunction) geoquad_nearby_count, METH_VARARGS|METH_KEYWORDS, "number of geoquads nearby would return" },
+	{ "iter_nearby", (PyCFunction) geoquad_iter_nearby, METH_VARARGS|METH_KEYWORDS, "get nearby geoquads, returns an iterator (in column order, never sorted)" },
+	{ "nearby_ranges", (PyCFunction) geoquad_nearby_ranges, METH_VARARGS|METH_KEYWORDS, "get nearby geoquads as a list of inclusive (lo, hi) Morton ranges" },
+	{ "nearby_many", (PyCFunction) geoquad_nearby_many, METH_VARARGS|METH_KEYWORDS, "nearby for a buffer of geoquads, as a sorted union, per origin (quads, offsets) or ranges" },
+	{ "haversine_distance", (PyCFunction) geoquad_haversine_distance, METH_VARARGS, "haversine distance beteween two (lat, lng) tuples" },
+	{ "haversine_many", (PyCFunction) geoquad_haversine_many, METH_VARARGS|METH_KEYWORDS, "haversine distances between buffers of lat1, lng1, lat2, lng2" },
+	{ "distances_from", (PyCFunction) geoquad_distances_from, METH_VARARGS|METH_KEYWORDS, "haversine distances from a (lat, lng) origin to buffers of lats and lngs" },
+	{ "within_radius", (PyCFunction) geoquad_within_radius, METH_VARARGS|METH_KEYWORDS, "which points are within a radius of a (lat, lng) origin, returns a mask or indices" },
+	{ "set_bmi2", (PyCFunction) geoquad_set_bmi2, METH_VARARGS, "enable or disable the BMI2 interleave path, returns the previous setting" },
+	{ "nearby_annulus", (PyCFunction) geoquad_nearby_annulus, METH_VARARGS|METH_KEYWORDS, "geoquads nearby within r_outer but not r_inner, optionally within a (start, end) bearing sector" },
+	{ "nearby_delta", (PyCFunction) geoquad_nearby_delta, METH_VARARGS|METH_KEYWORDS, "(added, removed) geoquads when the nearby origin moves from old to new" },
+	{ "bbox_cover", (PyCFunction) geoquad_bbox_cover, METH_VARARGS|METH_KEYWORDS, "geoquads in a (south, west, north, east) box, as (lo, hi) Morton ranges or an array" },
+	{ "polygon_cover", (PyCFunction) geoquad_polygon_cover, METH_VARARGS|METH_KEYWORDS, "(interior, boundary) geoquads of polygon rings, by the even-odd rule" },
+	{ "set_nearby_cache", (PyCFunction) geoquad_set_nearby_cache, METH_VARARGS, "enable or disable (and clear) the nearby template cache, returns the previous setting" },
+	{ "set_simd", (PyCFunction) geoquad_set_simd, METH_VARARGS, "select the distance kernels ('scalar', 'avx2' or 'avx512'), returns the previous one" },
+	{ "set_num_threads", (PyCFunction) geoquad_set_num_threads, METH_VARARGS, "set the number of threads batch functions use (0 for one per CPU), returns the previous number" },
+	{ "get_num_threads", (PyCFunction) geoquad_get_num_threads, METH_NOARGS, "number of threads batch functions use" },
+	{ NULL }
+};
+
+PyMODINIT_FUNC initgeoquad(void)
+{
+	PyObject *m = Py_InitModule3("geoquad", geoquad_methods, "test");
+	PyObject *array_mod;
+
+	if (!(array_mod = PyImport_ImportModule("array")))
+		return;
+	array_type = PyObject_GetAttrString(array_mod, "array");
+	Py_DECREF(array_mod);
+	if (!array_type)
+		return;
+	if (PyType_Ready(&NearbyIterType) < 0)
+		return;
+	if (PyType_Ready(&GeoIndexType) < 0)
+		return;
+	if (PyType_Ready(&DynamicGeoIndexType) < 0)
+		return;
+	pool.size = pool_size_for(0);
+	pthread_atfork(NULL, NULL, pool_atfork_child);
+
+	gq_init();
+	PyObject_SetAttrString(m, "HAVE_BMI2", PyBool_FromLong(gq_have_bmi2));
+	PyObject_SetAttrString(m, "SIMD", PyString_FromString(simd_names[gq_have_simd]));
+#ifdef GEOQUAD_SPARSE_DECODE
+	PyObject_SetAttrString(m, "SPARSE_DECODE", Py_True);
+#else
+	PyObject_SetAttrString(m, "SPARSE_DECODE", Py_False);
+#endif
 
 	/* TODO: There should be error checking here, but I can't figure out how
 	 * to signal failure from a module's init method... */
-	PyObject_SetAttrString(m, "LONGITUDE_MIN", PyFloat_FromDouble(LONGITUDE_MIN));
-	PyObject_SetAttrString(m, "LONGITUDE_MAX", PyFloat_FromDouble(LONGITUDE_MAX));
-	PyObject_SetAttrString(m, "LATITUDE_MIN", PyFloat_FromDouble(LATITUDE_MIN));
-	PyObject_SetAttrString(m, "LATITUDE_MAX", PyFloat_FromDouble(LATITUDE_MAX));
-	PyObject_SetAttrString(m, "MILES_PER_LATITUDE", PyFloat_FromDouble(MILES_PER_LATITUDE));
+	PyObject_SetAttrString(m, "LONGITUDE_MIN", PyFloat_FromDouble(GEOQUAD_LONGITUDE_MIN));
+	PyObject_SetAttrString(m, "LONGITUDE_MAX", PyFloat_FromDouble(GEOQUAD_LONGITUDE_MAX));
+	PyObject_SetAttrString(m, "LATITUDE_MIN", PyFloat_FromDouble(GEOQUAD_LATITUDE_MIN));
+	PyObject_SetAttrString(m, "LATITUDE_MAX", PyFloat_FromDouble(GEOQUAD_LATITUDE_MAX));
+	PyObject_SetAttrString(m, "MILES_PER_LATITUDE", PyFloat_FromDouble(GEOQUAD_MILES_PER_LATITUDE));
 	PyObject_SetAttrString(m, "GEOQUAD_STEP", PyFloat_FromDouble(GEOQUAD_STEP));
 	PyObject_SetAttrString(m, "GEOQUAD_INV", PyFloat_FromDouble(GEOQUAD_INV));
 	PyObject_SetAttrString(m, "GEOQUAD_FUZZ", PyFloat_FromDouble(GEOQUAD_FUZZ));
+	PyModule_AddIntConstant(m, "BAD_LATITUDE", GEOQUAD_BAD_LATITUDE);
+	PyModule_AddIntConstant(m, "BAD_LONGITUDE", GEOQUAD_BAD_LONGITUDE);
+	Py_INCREF(&GeoIndexType);
+	PyModule_AddObject(m, "GeoIndex", (PyObject *) &GeoIndexType);
+	Py_INCREF(&DynamicGeoIndexType);
+	PyModule_AddObject(m, "DynamicGeoIndex", (PyObject *) &DynamicGeoIndexType);
 }
 /* vim: set ts=4 sw=4 tw=78 noet: */
@@ -0,0 +1,131 @@
+/*
+ * C++ interface to libgeoquad.
+ *
+ * Encoding, decoding and the directional functions are reimplemented here as
+ * constexpr (C++14) with shifts and masks, so they can be evaluated at
+ * compile time and give the same results as the C versions. Everything else
+ * wraps the C API in libgeoquad.h.
+ */
+#ifndef _GEOQUAD_HPP_
+#define _GEOQUAD_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "libgeoquad.h"
+
+namespace geoquad {
+
+constexpr double step = GEOQUAD_STEP;
+constexpr double latitude_min = GEOQUAD_LATITUDE_MIN;
+constexpr double latitude_max = GEOQUAD_LATITUDE_MAX;
+constexpr double longitude_min = GEOQUAD_LONGITUDE_MIN;
+constexpr double longitude_max = GEOQUAD_LONGITUDE_MAX;
+
+/* Spreads the bits of @x into the even bits of the result */
+constexpr uint32_t interleave_half(uint16_t x)
+{
+	uint32_t z = x;
+	z = (z | (z << 8)) & 0x00FF00FF;
+	z = (z | (z << 4)) & 0x0F0F0F0F;
+	z = (z | (z << 2)) & 0x33333333;
+	z = (z | (z << 1)) & 0x55555555;
+	return z;
+}
+
+constexpr uint32_t interleave_full(uint16_t x, uint16_t y)
+{
+	return interleave_half(x) | (interleave_half(y) << 1);
+}
+
+/* Gathers the even bits of @z */
+constexpr uint16_t deinterleave_half(uint32_t z)
+{
+	z &= 0x55555555;
+	z = (z | (z >> 1)) & 0x33333333;
+	z = (z | (z >> 2)) & 0x0F0F0F0F;
+	z = (z | (z >> 4)) & 0x00FF00FF;
+	z = (z | (z >> 8)) & 0x0000FFFF;
+	return static_cast<uint16_t>(z);
+}
+
+constexpr bool in_range(double lat, double lng)
+{
+	return lat >= latitude_min && lat <= latitude_max && lng >= longitude_min && lng <= longitude_max;
+}
+
+/* The geoquad containing (@lat, @lng), which must be in range */
+constexpr uint32_t create(double lat, double lng)
+{
+	return interleave_full(static_cast<uint16_t>((lat - latitude_min) * GEOQUAD_INV),
+	                       static_cast<uint16_t>((lng - longitude_min) * GEOQUAD_INV));
+}
+
+struct point {
+	double lat;
+	double lng;
+};
+
+/* The SW corner of a geoquad */
+constexpr point parse(uint32_t gq)
+{
+	return point{(deinterleave_half(gq) * step) + latitude_min,
+	             (deinterleave_half(gq >> 1) * step) + longitude_min};
+}
+
+constexpr point center(uint32_t gq)
+{
+	return point{parse(gq).lat + step / 2, parse(gq).lng + step / 2};
+}
+
+constexpr uint32_t northof(uint32_t gq)
+{
+	return (gq & GEOQUAD_INTER32L) | (interleave_half(static_cast<uint16_t>(deinterleave_half(gq >> 1) + 1)) << 1);
+}
+
+constexpr uint32_t southof(uint32_t gq)
+{
+	return (gq & GEOQUAD_INTER32L) | (interleave_half(static_cast<uint16_t>(deinterleave_half(gq >> 1) - 1)) << 1);
+}
+
+constexpr uint32_t eastof(uint32_t gq)
+{
+	return (gq & GEOQUAD_INTER32M) | interleave_half(static_cast<uint16_t>(deinterleave_half(gq) + 1));
+}
+
+constexpr uint32_t westof(uint32_t gq)
+{
+	return (gq & GEOQUAD_INTER32M) | interleave_half(static_cast<uint16_t>(deinterleave_half(gq) - 1));
+}
+
+/* In miles */
+inline double haversine_distance(point a, point b)
+{
+	return gq_haversine_distance(a.lat, a.lng, b.lat, b.lng);
+}
+
+/* The geoquads within @radius miles of @gq, see libgeoquad.h. Throws
+ * std::invalid_argument if @radius isn't finite, and std::bad_alloc if out
+ * of memory. */
+inline std::vector<uint32_t> nearby(uint32_t gq, double radius, bool fuzz = false)
+{
+	uint32_t *quads;
+	std::ptrdiff_t n = gq_nearby(gq, radius, fuzz, &quads);
+
+	if (n == GEOQUAD_BAD_RADIUS)
+		throw std::invalid_argument("radius must be finite");
+	if (n < 0)
+		throw std::bad_alloc();
+	std::vector<uint32_t> ret(quads, quads + n);
+	std::free(quads);
+	return ret;
+}
+
+}
+
+#endif
@@ -0,0 +1,843 @@
+#include "libgeoquad.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TO_RADIANS(x)   (x * M_PI / 180.0)
+
+/* The highest odd bits half of a valid geoquad, which gq_nearby_halves
+ * calls the lat (see the note in libgeoquad.h) */
+#define HALF_MAX  ((int) ((GEOQUAD_LONGITUDE_MAX - GEOQUAD_LONGITUDE_MIN) * GEOQUAD_INV))
+
+/* The highest even bits half, which gq_nearby_halves calls the lng and
+ * walks as columns */
+#define COLUMN_MAX  ((int) ((GEOQUAD_LATITUDE_MAX - GEOQUAD_LATITUDE_MIN) * GEOQUAD_INV))
+
+/* gq_morton_forward[b] is the byte b with a zero bit inserted above each
+ * of its bits */
+const uint16_t gq_morton_forward[256] = {
+	0x0000, 0x0001, 0x0004, 0x0005, 0x0010, 0x0011, 0x0014, 0x0015,
+	0x0040, 0x0041, 0x0044, 0x0045, 0x0050, 0x0051, 0x0054, 0x0055,
+	0x0100, 0x0101, 0x0104, 0x0105, 0x0110, 0x0111, 0x0114, 0x0115,
+	0x0140, 0x0141, 0x0144, 0x0145, 0x0150, 0x0151, 0x0154, 0x0155,
+	0x0400, 0x0401, 0x0404, 0x0405, 0x0410, 0x0411, 0x0414, 0x0415,
+	0x0440, 0x0441, 0x0444, 0x0445, 0x0450, 0x0451, 0x0454, 0x0455,
+	0x0500, 0x0501, 0x0504, 0x0505, 0x0510, 0x0511, 0x0514, 0x0515,
+	0x0540, 0x0541, 0x0544, 0x0545, 0x0550, 0x0551, 0x0554, 0x0555,
+	0x1000, 0x1001, 0x1004, 0x1005, 0x1010, 0x1011, 0x1014, 0x1015,
+	0x1040, 0x1041, 0x1044, 0x1045, 0x1050, 0x1051, 0x1054, 0x1055,
+	0x1100, 0x1101, 0x1104, 0x1105, 0x1110, 0x1111, 0x1114, 0x1115,
+	0x1140, 0x1141, 0x1144, 0x1145, 0x1150, 0x1151, 0x1154, 0x1155,
+	0x1400, 0x1401, 0x1404, 0x1405, 0x1410, 0x1411, 0x1414, 0x1415,
+	0x1440, 0x1441, 0x1444, 0x1445, 0x1450, 0x1451, 0x1454, 0x1455,
+	0x1500, 0x1501, 0x1504, 0x1505, 0x1510, 0x1511, 0x1514, 0x1515,
+	0x1540, 0x1541, 0x1544, 0x1545, 0x1550, 0x1551, 0x1554, 0x1555,
+	0x4000, 0x4001, 0x4004, 0x4005, 0x4010, 0x4011, 0x4014, 0x4015,
+	0x4040, 0x4041, 0x4044, 0x4045, 0x4050, 0x4051, 0x4054, 0x4055,
+	0x4100, 0x4101, 0x4104, 0x4105, 0x4110, 0x4111, 0x4114, 0x4115,
+	0x4140, 0x4141, 0x4144, 0x4145, 0x4150, 0x4151, 0x4154, 0x4155,
+	0x4400, 0x4401, 0x4404, 0x4405, 0x4410, 0x4411, 0x4414, 0x4415,
+	0x4440, 0x4441, 0x4444, 0x4445, 0x4450, 0x4451, 0x4454, 0x4455,
+	0x4500, 0x4501, 0x4504, 0x4505, 0x4510, 0x4511, 0x4514, 0x4515,
+	0x4540, 0x4541, 0x4544, 0x4545, 0x4550, 0x4551, 0x4554, 0x4555,
+	0x5000, 0x5001, 0x5004, 0x5005, 0x5010, 0x5011, 0x5014, 0x5015,
+	0x5040, 0x5041, 0x5044, 0x5045, 0x5050, 0x5051, 0x5054, 0x5055,
+	0x5100, 0x5101, 0x5104, 0x5105, 0x5110, 0x5111, 0x5114, 0x5115,
+	0x5140, 0x5141, 0x5144, 0x5145, 0x5150, 0x5151, 0x5154, 0x5155,
+	0x5400, 0x5401, 0x5404, 0x5405, 0x5410, 0x5411, 0x5414, 0x5415,
+	0x5440, 0x5441, 0x5444, 0x5445, 0x5450, 0x5451, 0x5454, 0x5455,
+	0x5500, 0x5501, 0x5504, 0x5505, 0x5510, 0x5511, 0x5514, 0x5515,
+	0x5540, 0x5541, 0x5544, 0x5545, 0x5550, 0x5551, 0x5554, 0x5555
+};
+
+#ifdef GEOQUAD_SPARSE_DECODE
+/* The inverse of gq_morton_forward, filled in by gq_init */
+uint8_t gq_morton_sparse[0x5556];
+#endif
+
+int gq_have_bmi2 = 0;
+int gq_use_bmi2 = 0;
+
+#ifdef GEOQUAD_BMI2
+#include <cpuid.h>
+
+#ifndef bit_BMI2
+#define bit_BMI2 (1 << 8)
+#endif
+
+static int cpu_has_bmi2(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx & bit_BMI2) != 0;
+}
+#endif
+
+/* Creates @n geoquads from the @lats and @lngs arrays. Invalid coordinates
+ * are flagged in @errors and produce a geoquad of 0. Returns the number of
+ * invalid coordinates.
+ */
+size_t
+gq_create_many(const double *lats, const double *lngs, uint32_t *out, uint8_t *errors, size_t n)
+{
+	size_t i, bad = 0;
+	uint8_t err;
+
+	for (i = 0; i < n; i++) {
+		err = 0;
+		if (!gq_lat_in_range(lats[i]))
+			err |= GEOQUAD_BAD_LATITUDE;
+		if (!gq_lng_in_range(lngs[i]))
+			err |= GEOQUAD_BAD_LONGITUDE;
+		errors[i] = err;
+		if (err) {
+			out[i] = 0;
+			bad++;
+		} else {
+			out[i] = gq_interleave_full(gq_lat_to_half(lats[i]), gq_lng_to_half(lngs[i]));
+		}
+	}
+	return bad;
+}
+
+/* Decodes @n geoquads into the SW corner of each quad, plus @offset degrees
+ * in each direction (so an @offset of half a step gives the center).
+ */
+void
+gq_decode_many(const uint32_t *gqs, double *lats, double *lngs, size_t n, double offset)
+{
+	uint16_t half_lat, half_lng;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		gq_deinterleave_full(gqs[i], &half_lat, &half_lng);
+		lats[i] = ((half_lat * GEOQUAD_STEP) + GEOQUAD_LATITUDE_MIN) + offset;
+		lngs[i] = ((half_lng * GEOQUAD_STEP) + GEOQUAD_LONGITUDE_MIN) + offset;
+	}
+}
+
+double
+gq_haversine_distance(double lat1, double lng1, double lat2, double lng2)
+{
+	double shlat, shlng;
+
+	lng1 = TO_RADIANS(lng1);
+	lat1 = TO_RADIANS(lat1);
+	lng2 = TO_RADIANS(lng2);
+	lat2 = TO_RADIANS(lat2);
+
+	shlat = sin((lat2 - lat1) / 2.0);
+	shlng = sin((lng2 - lng1) / 2.0);
+
+	return GEOQUAD_EARTH_RADIUS_MI * 2.0 * asin(fmin(1.0, sqrt(shlat * shlat + cos(lat1) * cos(lat2) * shlng * shlng)));
+}
+
+/***************************
+ * SIMD HAVERSINE
+ *
+ * The batch distance functions evaluate the haversine formula with
+ * polynomial approximations of sin and asin instead of calling libm, which
+ * lets the compiler vectorize the loops. The loop bodies are compiled once
+ * for AVX2 and once for AVX-512, both with FMA so that they contract the
+ * same way and give the same results, and the widest one the CPU supports
+ * is picked by gq_init. GCC only vectorizes at -O2 when the cost model says
+ * it's very cheap, which these loops aren't, so the kernels turn on
+ * tree-vectorize themselves. The scalar fallback calls gq_haversine_distance.
+ *
+ * Coordinates are expected to be in the range accepted by gq_create_many. For those
+ * the polynomial kernels agree with gq_haversine_distance to within 1e-9 miles,
+ * except for points within a few miles of being antipodal. There the
+ * haversine formula is ill-conditioned (h rounds to 1) and the two can differ
+ * by up to 2e-4 miles, about 1e-8 relative.
+ **************************/
+
+int gq_have_simd = GEOQUAD_SIMD_SCALAR;
+int gq_use_simd = GEOQUAD_SIMD_SCALAR;
+
+/* pi split in two so that argument reduction is exact to ~1e-32 */
+#define PI_HI  3.141592653589793116
+#define PI_LO  1.2246467991473532e-16
+
+/* Adding and subtracting this rounds a double (|x| < 2^51) to an integer */
+#define ROUND_MAGIC  6755399441055744.0
+
+/* sin(x) for |x| <= pi/2, Taylor series through x^19 (error < 3e-16) */
+static inline double poly_sin(double x)
+{
+	double x2 = x * x;
+	double p = -8.22063524662433e-18;
+	p = p * x2 + 2.8114572543455206e-15;
+	p = p * x2 - 7.647163731819816e-13;
+	p = p * x2 + 1.6059043836821613e-10;
+	p = p * x2 - 2.505210838544172e-08;
+	p = p * x2 + 2.7557319223985893e-06;
+	p = p * x2 - 0.0001984126984126984;
+	p = p * x2 + 0.008333333333333333;
+	p = p * x2 - 0.16666666666666666;
+	return x + x * x2 * p;
+}
+
+/* asin(sqrt(u)) / sqrt(u) for 0 <= u <= 0.25, Taylor series through
+ * asin's x^45 term (error < 2e-16) */
+static inline double poly_asin_ratio(double u)
+{
+	double p = 0.00265787063820729;
+	p = p * u + 0.002846178401108942;
+	p = p * u + 0.0030578216492580306;
+	p = p * u + 0.003297059503473485;
+	p = p * u + 0.0035692053938259347;
+	p = p * u + 0.003880964558837669;
+	p = p * u + 0.004240907093679363;
+	p = p * u + 0.004660143486915096;
+	p = p * u + 0.005153309682319905;
+	p = p * u + 0.005740037670841924;
+	p = p * u + 0.006447210311889649;
+	p = p * u + 0.0073125258735988454;
+	p = p * u + 0.008390335809616815;
+	p = p * u + 0.009761609529194078;
+	p = p * u + 0.011551800896139705;
+	p = p * u + 0.01396484375;
+	p = p * u + 0.017352764423076924;
+	p = p * u + 0.022372159090909092;
+	p = p * u + 0.030381944444444444;
+	p = p * u + 0.044642857142857144;
+	p = p * u + 0.075;
+	p = p * u + 0.16666666666666666;
+	return p * u + 1.0;
+}
+
+/* sin(x)^2 for any x, by reducing x into [-pi/2, pi/2] */
+static inline double poly_sin2(double x)
+{
+	double k = ((x * (1.0 / M_PI)) + ROUND_MAGIC) - ROUND_MAGIC;
+	double r = (x - k * PI_HI) - k * PI_LO;
+	double sr = poly_sin(r);
+	return sr * sr;
+}
+
+/* cos(x) for |x| <= pi, which covers all valid latitudes */
+static inline double poly_cos(double x)
+{
+	return poly_sin((M_PI / 2.0) - fabs(x));
+}
+
+/* The haversine of the central angle between two points, in radians */
+static inline double poly_haversine_h(double lat1, double coslat1, double lng1, double lat2, double coslat2, double lng2)
+{
+	return poly_sin2((lat2 - lat1) * 0.5) + coslat1 * coslat2 * poly_sin2((lng2 - lng1) * 0.5);
+}
+
+/* Converts the haversine @h of a central angle to a distance in miles, i.e.
+ * 2 R asin(sqrt(h)). For sqrt(h) > 0.5 this uses
+ * asin(s) = pi/2 - 2 asin(sqrt((1 - s) / 2)) to stay within the range where
+ * the series converges quickly. Both cases are computed so there's no branch.
+ */
+static inline double poly_h_to_miles(double h)
+{
+	double s, u, a;
+
+	h = h < 1.0 ? h : 1.0;
+	s = sqrt(h);
+	u = h <= 0.25 ? h : (1.0 - s) * 0.5;
+	a = sqrt(u) * poly_asin_ratio(u);
+	a = h <= 0.25 ? a : (M_PI / 2.0) - 2.0 * a;
+	return GEOQUAD_EARTH_RADIUS_MI * 2.0 * a;
+}
+
+static inline __attribute__((always_inline)) void
+haversine_many_poly(const double *lat1, const double *lng1, const double *lat2, const double *lng2, double *out, size_t n)
+{
+	size_t i;
+	double la1, la2;
+
+	for (i = 0; i < n; i++) {
+		la1 = TO_RADIANS(lat1[i]);
+		la2 = TO_RADIANS(lat2[i]);
+		out[i] = poly_h_to_miles(poly_haversine_h(la1, poly_cos(la1), TO_RADIANS(lng1[i]), la2, poly_cos(la2), TO_RADIANS(lng2[i])));
+	}
+}
+
+/* As haversine_many_poly but from a single origin, given in radians along
+ * with the cosine of its latitude. */
+static inline __attribute__((always_inline)) void
+distances_from_poly(double lat1, double coslat1, double lng1, const double *lats, const double *lngs, double *out, size_t n)
+{
+	size_t i;
+	double la2;
+
+	for (i = 0; i < n; i++) {
+		la2 = TO_RADIANS(lats[i]);
+		out[i] = poly_h_to_miles(poly_haversine_h(lat1, coslat1, lng1, la2, poly_cos(la2), TO_RADIANS(lngs[i])));
+	}
+}
+
+/* Sets mask[i] to whether the haversine of the angle from the origin (in
+ * radians) to (lats[i], lngs[i]) is at most @max_h. */
+static inline __attribute__((always_inline)) void
+within_radius_poly(double lat1, double coslat1, double lng1, double max_h, const double *lats, const double *lngs, uint8_t *mask, size_t n)
+{
+	size_t i;
+	double la2;
+
+	for (i = 0; i < n; i++) {
+		la2 = TO_RADIANS(lats[i]);
+		mask[i] = poly_haversine_h(lat1, coslat1, lng1, la2, poly_cos(la2), TO_RADIANS(lngs[i])) <= max_h;
+	}
+}
+
+#ifdef GEOQUAD_SIMD
+__attribute__((target("avx2,fma"), optimize("tree-vectorize"))) static void
+haversine_many_avx2(const double *lat1, const double *lng1, const double *lat2, const double *lng2, double *out, size_t n)
+{
+	haversine_many_poly(lat1, lng1, lat2, lng2, out, n);
+}
+
+__attribute__((target("avx512f,fma,prefer-vector-width=512"), optimize("tree-vectorize"))) static void
+haversine_many_avx512(const double *lat1, const double *lng1, const double *lat2, const double *lng2, double *out, size_t n)
+{
+	haversine_many_poly(lat1, lng1, lat2, lng2, out, n);
+}
+
+__attribute__((target("avx2,fma"), optimize("tree-vectorize"))) static void
+distances_from_avx2(double lat1, double coslat1, double lng1, const double *lats, const double *lngs, double *out, size_t n)
+{
+	distances_from_poly(lat1, coslat1, lng1, lats, lngs, out, n);
+}
+
+__attribute__((target("avx512f,fma,prefer-vector-width=512"), optimize("tree-vectorize"))) static void
+distances_from_avx512(double lat1, double coslat1, double lng1, const double *lats, const double *lngs, double *out, size_t n)
+{
+	distances_from_poly(lat1, coslat1, lng1, lats, lngs, out, n);
+}
+
+__attribute__((target("avx2,fma"), optimize("tree-vectorize"))) static void
+within_radius_avx2(double lat1, double coslat1, double lng1, double max_h, const double *lats, const double *lngs, uint8_t *mask, size_t n)
+{
+	within_radius_poly(lat1, coslat1, lng1, max_h, lats, lngs, mask, n);
+}
+
+__attribute__((target("avx512f,fma,prefer-vector-width=512"), optimize("tree-vectorize"))) static void
+within_radius_avx512(double lat1, double coslat1, double lng1, double max_h, const double *lats, const double *lngs, uint8_t *mask, size_t n)
+{
+	within_radius_poly(lat1, coslat1, lng1, max_h, lats, lngs, mask, n);
+}
+
+static int cpu_simd_level(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("fma"))
+		return GEOQUAD_SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return GEOQUAD_SIMD_AVX2;
+	return GEOQUAD_SIMD_SCALAR;
+}
+#endif
+
+/* Computes the distances between the pairs (lat1[i], lng1[i]) and
+ * (lat2[i], lng2[i]) in miles. */
+void
+gq_haversine_many(const double *lat1, const double *lng1, const double *lat2, const double *lng2, double *out, size_t n)
+{
+	size_t i;
+
+#ifdef GEOQUAD_SIMD
+	if (gq_use_simd == GEOQUAD_SIMD_AVX512) {
+		haversine_many_avx512(lat1, lng1, lat2, lng2, out, n);
+		return;
+	}
+	if (gq_use_simd == GEOQUAD_SIMD_AVX2) {
+		haversine_many_avx2(lat1, lng1, lat2, lng2, out, n);
+		return;
+	}
+#endif
+	for (i = 0; i < n; i++)
+		out[i] = gq_haversine_distance(lat1[i], lng1[i], lat2[i], lng2[i]);
+}
+
+/* Computes the distances in miles from (@lat, @lng) to each of the points
+ * (lats[i], lngs[i]). The origin's radians and cosine are only computed once.
+ */
+void
+gq_distances_from(double lat, double lng, const double *lats, const double *lngs, double *out, size_t n)
+{
+	double lat1, lng1, coslat1, lat2, lng2, shlat, shlng;
+	size_t i;
+
+	lat1 = TO_RADIANS(lat);
+	lng1 = TO_RADIANS(lng);
+	coslat1 = cos(lat1);
+
+#ifdef GEOQUAD_SIMD
+	if (gq_use_simd == GEOQUAD_SIMD_AVX512) {
+		distances_from_avx512(lat1, coslat1, lng1, lats, lngs, out, n);
+		return;
+	}
+	if (gq_use_simd == GEOQUAD_SIMD_AVX2) {
+		distances_from_avx2(lat1, coslat1, lng1, lats, lngs, out, n);
+		return;
+	}
+#endif
+	for (i = 0; i < n; i++) {
+		lat2 = TO_RADIANS(lats[i]);
+		lng2 = TO_RADIANS(lngs[i]);
+		shlat = sin((lat2 - lat1) / 2.0);
+		shlng = sin((lng2 - lng1) / 2.0);
+		out[i] = GEOQUAD_EARTH_RADIUS_MI * 2.0 * asin(fmin(1.0, sqrt(shlat * shlat + coslat1 * cos(lat2) * shlng * shlng)));
+	}
+}
+
+/* Sets mask[i] to whether (lats[i], lngs[i]) is within @radius miles of
+ * (@lat, @lng). Rather than computing distances, the haversine term of each
+ * point is compared to sin^2(radius / 2R), which skips the asin and sqrt.
+ * Returns the number of points within the radius.
+ */
+size_t
+gq_within_radius(double lat, double lng, double radius, const double *lats, const double *lngs, uint8_t *mask, size_t n)
+{
+	double lat1, lng1, coslat1, lat2, lng2, shlat, shlng, max_h;
+	size_t i, count = 0;
+
+	lat1 = TO_RADIANS(lat);
+	lng1 = TO_RADIANS(lng);
+	coslat1 = cos(lat1);
+
+	/* A negative or NaN radius matches nothing, not even the origin. Beyond
+	 * half the circumference everything is in range; h can come out a hair
+	 * above 1 so don't use sin^2(pi/2) there. */
+	if (!(radius >= 0)) {
+		max_h = -1.0;
+	} else if (radius >= GEOQUAD_EARTH_RADIUS_MI * M_PI) {
+		max_h = 2.0;
+	} else {
+		max_h = sin(radius / (2.0 * GEOQUAD_EARTH_RADIUS_MI));
+		max_h *= max_h;
+	}
+
+#ifdef GEOQUAD_SIMD
+	if (gq_use_simd == GEOQUAD_SIMD_AVX512) {
+		within_radius_avx512(lat1, coslat1, lng1, max_h, lats, lngs, mask, n);
+		goto count;
+	}
+	if (gq_use_simd == GEOQUAD_SIMD_AVX2) {
+		within_radius_avx2(lat1, coslat1, lng1, max_h, lats, lngs, mask, n);
+		goto count;
+	}
+#endif
+	for (i = 0; i < n; i++) {
+		lat2 = TO_RADIANS(lats[i]);
+		lng2 = TO_RADIANS(lngs[i]);
+		shlat = sin((lat2 - lat1) / 2.0);
+		shlng = sin((lng2 - lng1) / 2.0);
+		mask[i] = (shlat * shlat + coslat1 * cos(lat2) * shlng * shlng) <= max_h;
+	}
+
+#ifdef GEOQUAD_SIMD
+count:
+#endif
+	for (i = 0; i < n; i++)
+		count += mask[i];
+	return count;
+}
+
+/* Returns the number of geoquads described by @halves, which always includes
+ * the top geoquad of each column. */
+size_t
+gq_nearby_total(const uint16_t halves[], size_t len)
+{
+	size_t i, total = 0;
+
+	for (i = 0; i < len; i++) {
+		total++;
+		if (halves[i] > halves[len + i])
+			total += halves[i] - halves[len + i];
+	}
+	return total;
+}
+
+/* Solves for the range [@lo, @hi] of latitudes (in degrees, in the frame
+ * gq_haversine_distance is called with below) on the meridian @lng that are
+ * within @radius miles of (@lat0, @lng0). Writing the distance condition as
+ * cos(angle) >= cos(radius / R) gives
+ *
+ *   cos(lat0) cos(lng - lng0) cos(lat) + sin(lat0) sin(lat) >= cos(radius / R)
+ *
+ * i.e. M cos(lat - phi) >= cos(radius / R) with M and phi from the
+ * coefficients. Returns 0 if no latitude on the meridian is close enough.
+ */
+static int
+column_extent(double lat0, double lng0, double lng, double radius, double *lo, double *hi)
+{
+	double p, q, m, c, phi, alpha, dlng;
+
+	dlng = lng - lng0;
+	p = cos(TO_RADIANS(lat0)) * cos(TO_RADIANS(dlng));
+	q = sin(TO_RADIANS(lat0));
+	m = hypot(p, q);
+	c = (radius >= GEOQUAD_EARTH_RADIUS_MI * M_PI) ? -1.0 : cos(radius / GEOQUAD_EARTH_RADIUS_MI);
+	if (c > m) {
+		*lo = *hi = lat0;
+		return 0;
+	}
+	phi = atan2(q, p);
+	alpha = acos(fmin(1.0, c / m));
+	*lo = (phi - alpha) * 180.0 / M_PI;
+	*hi = (phi + alpha) * 180.0 / M_PI;
+	return 1;
+}
+
+/* Whether the point @offset degrees north of the SW corner of row @lat, on
+ * the meridian @edge, is within @radius of the origin. This is the exact
+ * test the column bounds in gq_nearby_halves are defined by. */
+static inline int in_circle(int lat, double offset, double edge, double f_lat_orig, double f_lng_orig, double radius)
+{
+	return gq_haversine_distance(gq_half_to_lat((uint16_t) lat) + offset, edge, f_lat_orig, f_lng_orig) <= radius;
+}
+
+/***************************
+ * NEARBY TEMPLATE CACHE
+ *
+ * The shape of a nearby circle only depends on the row of the origin (its
+ * lat, in gq_nearby_halves' terms), the radius and the fuzz flag: moving the
+ * origin along the other axis just translates the halves array. Recently
+ * used shapes are kept in a small direct mapped cache as offsets from the
+ * origin, so repeated queries with the same radii skip the column bound
+ * computation entirely. All access is under template_lock.
+ **************************/
+
+#define TEMPLATE_SLOTS 256
+
+typedef struct {
+	uint16_t *offsets;  /* halves relative to the origin row, NULL if empty */
+	size_t count;       /* number of columns */
+	uint16_t lng_w;     /* westernmost column relative to the origin */
+	uint16_t lat;
+	int fuzz;
+	double radius;
+} nearby_template;
+
+static nearby_template templates[TEMPLATE_SLOTS];
+static pthread_mutex_t template_lock = PTHREAD_MUTEX_INITIALIZER;
+static int use_templates = 1;
+
+static size_t template_slot(uint16_t lat, double radius, int fuzz)
+{
+	uint64_t h;
+
+	memcpy(&h, &radius, sizeof(h));
+	h ^= ((uint64_t) lat << 1) | (fuzz != 0);
+	h *= 0x9E3779B97F4A7C15ULL;
+	return (size_t) (h >> 56) & (TEMPLATE_SLOTS - 1);
+}
+
+/* Looks up the template for the given key and, if found, translates it to
+ * the origin (@lng, @lat) into a newly allocated halves array. Returns 1 on a
+ * hit, 0 on a miss and -1 if out of memory. */
+static int
+template_lookup(uint16_t lng, uint16_t lat, double radius, int fuzz, uint16_t **halves_out, uint16_t *lng_w_out, size_t *count_out)
+{
+	nearby_template *t;
+	uint16_t *halves = NULL;
+	size_t i, count = 0;
+	int found = 0;
+
+	if (!use_templates)
+		return 0;
+
+	t = &templates[template_slot(lat, radius, fuzz)];
+	pthread_mutex_lock(&template_lock);
+	/* A template is only stored when its columns weren't clamped to the grid,
+	 * so it can only be translated to where they still fit */
+	if (t->offsets && (t->lat == lat) && (t->radius == radius) && (t->fuzz == fuzz) &&
+	    (lng + (int16_t) t->lng_w >= 0) && (lng + (int16_t) t->lng_w + (int) t->count - 1 <= COLUMN_MAX)) {
+		found = 1;
+		count = t->count;
+		if ((halves = malloc(sizeof(uint16_t) * ((count << 1) + 1)))) {
+			for (i = 0; i < (count << 1); i++)
+				halves[i] = t->offsets[i] + lat;
+			*lng_w_out = t->lng_w + lng;
+		}
+	}
+	pthread_mutex_unlock(&template_lock);
+
+	if (!found)
+		return 0;
+	if (!halves)
+		return -1;
+	*halves_out = halves;
+	*count_out = count;
+	return 1;
+}
+
+/* Saves the halves computed for origin (@lng, @lat) as a template. Failing to
+ * allocate memory for it isn't an error, the template just isn't saved. */
+static void
+template_store(uint16_t lng, uint16_t lat, double radius, int fuzz, const uint16_t *halves, uint16_t lng_w, size_t count)
+{
+	nearby_template *t;
+	uint16_t *offsets, *old;
+	size_t i;
+
+	if (!use_templates || !(offsets = malloc(sizeof(uint16_t) * ((count << 1) + 1))))
+		return;
+	for (i = 0; i < (count << 1); i++)
+		offsets[i] = halves[i] - lat;
+
+	t = &templates[template_slot(lat, radius, fuzz)];
+	pthread_mutex_lock(&template_lock);
+	old = t->offsets;
+	t->offsets = offsets;
+	t->count = count;
+	t->lng_w = lng_w - lng;
+	t->lat = lat;
+	t->fuzz = fuzz;
+	t->radius = radius;
+	pthread_mutex_unlock(&template_lock);
+
+	free(old);
+}
+
+static void
+template_clear(void)
+{
+	uint16_t *old;
+	size_t i;
+
+	for (i = 0; i < TEMPLATE_SLOTS; i++) {
+		pthread_mutex_lock(&template_lock);
+		old = templates[i].offsets;
+		templates[i].offsets = NULL;
+		pthread_mutex_unlock(&template_lock);
+		free(old);
+	}
+}
+
+/* Computes the bounds of the circle of @radius miles around @geoquad. The
+ * first half of the halves array holds the top row of each column and the
+ * second half the bottom row; a column with an odd number of geoquads has its
+ * middle one in both halves. On success the westernmost column is stored in
+ * @lng_w_out, the number of columns in @count_out, and a newly allocated
+ * halves array (to be freed with free) in @halves_out. Returns -1 if out of
+ * memory, or GEOQUAD_BAD_RADIUS if @radius isn't finite.
+ *
+ * Columns are handled as offsets from the origin's column, which makes the
+ * result exactly translation invariant and so safe to cache.
+ */
+int
+gq_nearby_halves(uint32_t geoquad, double radius, int fuzz, uint16_t **halves_out, uint16_t *lng_w_out, size_t *count_out)
+{
+	double radius_lat;
+	double f_lat_orig, f_lng, edge, lo, hi;
+	uint16_t lng, lat_orig;
+	size_t i, count;
+	int d, dw, de, top, bot, reach, top_max, bot_min, clamped, cached;
+	uint16_t *halves;
+
+	/* Parse the geoquad into a lng, lat and compute the easternmost
+	 * encompassing geoquad.
+	 *
+	 * FIXME: we might be off by one w/o the lat/lng conversion, is there a
+	 * way to fix that? Skipping it would be faster. */
+
+	/* Everything below converts the radius in geoquads to an int */
+	if (!isfinite(radius))
+		return GEOQUAD_BAD_RADIUS;
+
+	gq_deinterleave_full(geoquad, &lng, &lat_orig);
+
+	if ((cached = template_lookup(lng, lat_orig, radius, fuzz, halves_out, lng_w_out, count_out)))
+		return cached < 0 ? -1 : 0;
+
+	radius_lat = radius / GEOQUAD_MILES_PER_LATITUDE;
+
+	/* If the fuzz parameter evaluates to True, then the radius is
+	 * automatically "fuzzed" by making it incrementally bigger. It will be
+	 * fuzzed by the right amount so that any edge effects on the circle will
+	 * be handled correctly.
+	 */
+	if (fuzz)
+		radius_lat += GEOQUAD_FUZZ;
+
+	f_lat_orig = gq_half_to_lat(lat_orig);
+
+	/* No row is further than radius_lat from the origin's. Past that (or
+	 * past the poles) the haversine distance can come back down for large
+	 * radii, so the searches for each column's top and bottom stop there. */
+	reach = (radius_lat > 0) ? (int) ceil(fmin(radius_lat / GEOQUAD_STEP, HALF_MAX)) : 0;
+	top_max = lat_orig + reach;
+	if (top_max > HALF_MAX)
+		top_max = HALF_MAX;
+	if (top_max < lat_orig)
+		top_max = lat_orig;
+	bot_min = lat_orig - reach;
+	if (bot_min < 0)
+		bot_min = 0;
+
+	/* Get the westernmost geoquad. This is an overestimate since it's only
+	 * valid at the equator. At latitudes closer to the poles longitudes may
+	 * be closer together, meaning we'll have to adjust this a bit.
+	 *
+	 * This estimates the "widest" part, horizontally, of the circle at the
+	 * center. This may not actually be true for very large circles close to
+	 * the poles (and almost certainly isn't true when the circle contains a
+	 * pole). We don't expect that to happen in normal usage, however.
+	 *
+	 * Both ends are clamped to the grid's columns, otherwise the uint16
+	 * halves would wrap around onto invalid and duplicate columns. */
+	dw = -reach;
+	clamped = (dw < -(int) lng);
+	if (clamped)
+		dw = -(int) lng;
+	while ((dw < 0) && (gq_haversine_distance(f_lat_orig, (dw + 1) * GEOQUAD_STEP, f_lat_orig, 0.0) > radius))
+		dw++;
+
+	/* Get the easternmost quad. This is an overestimate, same note as above
+	 * really. */
+	de = (int) floor(fmin(radius_lat / GEOQUAD_STEP, HALF_MAX));
+	if (de > COLUMN_MAX - (int) lng) {
+		de = COLUMN_MAX - (int) lng;
+		clamped = 1;
+	}
+	while ((de > 0) && (gq_haversine_distance(f_lat_orig, de * GEOQUAD_STEP, f_lat_orig, 0.0) > radius))
+		de--;
+
+	/* A negative radius gives an empty circle */
+	if (de < dw)
+		de = dw - 1;
+	count = de - dw + 1;
+
+	halves = malloc(sizeof(uint16_t) * ((count << 1) + 1));
+	if (halves == NULL)
+		return -1;
+
+	i = 0;
+	for (d = dw; d <= de; d++) {
+		f_lng = d * GEOQUAD_STEP;
+
+		/* If on the west side of the ricle, use the east edge of each geoquad */
+		edge = (d <= 0) ? f_lng + GEOQUAD_STEP : f_lng;
+		column_extent(f_lat_orig, 0.0, edge, radius, &lo, &hi);
+
+		/* The top is the last geoquad north of the origin whose south edge
+		 * is in the circle. Start from the analytic solution and check it
+		 * against the haversine distance, which normally takes one step. */
+		if (!in_circle(lat_orig, 0.0, edge, f_lat_orig, 0.0, radius)) {
+			top = lat_orig - 1;
+		} else {
+			top = (int) floor((hi - GEOQUAD_LATITUDE_MIN * 2) / GEOQUAD_STEP);
+			if (top < lat_orig)
+				top = lat_orig;
+			if (top > top_max)
+				top = top_max;
+			while ((top > lat_orig) && !in_circle(top, 0.0, edge, f_lat_orig, 0.0, radius))
+				top--;
+			while ((top < top_max) && in_circle(top + 1, 0.0, edge, f_lat_orig, 0.0, radius))
+				top++;
+		}
+		halves[i] = (uint16_t) top;
+
+		/* Likewise the bottom is the last geoquad south of the origin whose
+		 * north edge is in the circle. */
+		if (!in_circle(lat_orig, GEOQUAD_STEP, edge, f_lat_orig, 0.0, radius)) {
+			bot = lat_orig + 1;
+		} else {
+			bot = (int) ceil((lo - GEOQUAD_STEP - GEOQUAD_LATITUDE_MIN * 2) / GEOQUAD_STEP);
+			if (bot > lat_orig)
+				bot = lat_orig;
+			if (bot < bot_min)
+				bot = bot_min;
+			while ((bot < lat_orig) && !in_circle(bot, GEOQUAD_STEP, edge, f_lat_orig, 0.0, radius))
+				bot++;
+			while ((bot > bot_min) && in_circle(bot - 1, GEOQUAD_STEP, edge, f_lat_orig, 0.0, radius))
+				bot--;
+		}
+		halves[i + count] = (uint16_t) bot;
+		i++;
+	}
+
+	if (!clamped)
+		template_store(lng, lat_orig, radius, fuzz, halves, lng + dw, count);
+
+	*halves_out = halves;
+	*lng_w_out = lng + dw;
+	*count_out = count;
+	return 0;
+}
+
+/* Writes the geoquads described by @halves into @out, which must have room
+ * for gq_nearby_total(halves, len) of them. Each column is walked southwards
+ * from its top with the same bit trick as gq_southof. */
+void
+gq_nearby_fill(const uint16_t halves[], uint16_t lng_w, size_t len, uint32_t *out)
+{
+	size_t i;
+	uint16_t t, b;
+	uint32_t q;
+	uint16_t lng;
+
+	lng = lng_w;
+	for (i = 0; i < len; i++) {
+		t = halves[i];
+		b = halves[len + i];
+
+		q = gq_interleave_full(lng, t);
+		*out++ = q;
+		while (t > b) {
+			q &= GEOQUAD_INTER32L;
+			t--;
+			q |= (gq_interleave_half(t) << 1);
+			*out++ = q;
+		}
+		lng++;
+	}
+}
+
+ptrdiff_t
+gq_nearby(uint32_t geoquad, double radius, int fuzz, uint32_t **out)
+{
+	uint16_t *halves, lng_w;
+	size_t count, total;
+	int err;
+
+	if ((err = gq_nearby_halves(geoquad, radius, fuzz, &halves, &lng_w, &count)) < 0)
+		return err;
+	total = gq_nearby_total(halves, count);
+	if (!(*out = malloc(sizeof(uint32_t) * (total + 1)))) {
+		free(halves);
+		return -1;
+	}
+	gq_nearby_fill(halves, lng_w, count, *out);
+	free(halves);
+	return (ptrdiff_t) total;
+}
+
+int
+gq_set_nearby_cache(int enable)
+{
+	int prev = use_templates;
+
+	use_templates = enable ? 1 : 0;
+	template_clear();
+	return prev;
+}
+
+void
+gq_init(void)
+{
+#ifdef GEOQUAD_SPARSE_DECODE
+	int b;
+
+	for (b = 0; b < 256; b++)
+		gq_morton_sparse[gq_morton_forward[b]] = (uint8_t) b;
+#endif
+#ifdef GEOQUAD_BMI2
+	gq_have_bmi2 = gq_use_bmi2 = cpu_has_bmi2();
+#endif
+#ifdef GEOQUAD_SIMD
+	gq_have_simd = gq_use_simd = cpu_simd_level();
+#endif
+}
@@ -0,0 +1,305 @@
+/*
+ * libgeoquad: geoquad encoding, neighbors, distances and nearby covers, with
+ * no dependency on Python.
+ *
+ * A geoquad is a 0.05 x 0.05 degree cell, numbered by interleaving the bits
+ * of its row (the "lat half", (lat + 90) * 20, in the even bits) and column
+ * (the "lng half", (lng + 180) * 20, in the odd bits) into a Morton code.
+ *
+ * The small functions are static inline so that they can be used in tight
+ * loops; everything else is in libgeoquad.c. Call gq_init() once at startup
+ * to enable the CPU specific code paths. Nothing here needs any other
+ * initialization, and the functions are safe to call from multiple threads.
+ */
+#ifndef _LIBGEOQUAD_H_
+#define _LIBGEOQUAD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GEOQUAD_LONGITUDE_MIN  -180.0
+#define GEOQUAD_LONGITUDE_MAX   180.0
+#define GEOQUAD_LATITUDE_MIN    -90.0
+#define GEOQUAD_LATITUDE_MAX     90.0
+
+#define GEOQUAD_EARTH_RADIUS_MI 3958.8641024047724
+
+#define GEOQUAD_MILES_PER_LATITUDE 68.70795454545454
+
+/* Unfortunately, in C we have (1 / 0.05 ) != 20
+ * This causes incompatibilites with the current Python code.
+ */
+#define GEOQUAD_STEP     0.05
+#define GEOQUAD_INV      20
+#define GEOQUAD_FUZZ     (GEOQUAD_STEP * 0.70710678118654757)
+
+/* Interleaved ones and zeroes, LSB = 1 */
+#define GEOQUAD_INTER32L 0x55555555
+
+/* Interleaved ones and zeroes, MSB = 1 */
+#define GEOQUAD_INTER32M 0xAAAAAAAA
+
+/* Flags set in the error mask by gq_create_many */
+#define GEOQUAD_BAD_LATITUDE   1
+#define GEOQUAD_BAD_LONGITUDE  2
+
+/* Returned by the nearby functions when the radius is NaN or infinite */
+#define GEOQUAD_BAD_RADIUS    -2
+
+/* Detects the CPU features below and turns on the ones available */
+void gq_init(void);
+
+/***************************
+ * INTERLEAVING
+ *
+ * On x86 the BMI2 PDEP/PEXT instructions do a half (de)interleave in a single
+ * instruction. Whether the CPU has them is only known at runtime, so they're
+ * emitted with inline asm (the intrinsics require compiling for BMI2) and
+ * selected with the gq_use_bmi2 flag, which gq_init sets from cpuid.
+ * The gq_morton_forward table and a shift/mask decode are the fallback.
+ *
+ * Building with -DGEOQUAD_SPARSE_DECODE replaces the shift/mask decode with
+ * the old lookup in gq_morton_sparse, a mostly zero ~21 KB table indexed by
+ * the even bits of each 16 bit half. It's only there as a baseline for
+ * bench.py.
+ **************************/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEOQUAD_BMI2
+#endif
+
+extern int gq_have_bmi2;
+extern int gq_use_bmi2;
+extern const uint16_t gq_morton_forward[256];
+#ifdef GEOQUAD_SPARSE_DECODE
+extern uint8_t gq_morton_sparse[0x5556];
+#endif
+
+#ifdef GEOQUAD_BMI2
+static inline uint32_t gq_pdep32(uint32_t x, uint32_t mask)
+{
+	uint32_t r;
+	__asm__ ("pdepl %2, %1, %0" : "=r" (r) : "r" (x), "rm" (mask));
+	return r;
+}
+
+static inline uint32_t gq_pext32(uint32_t x, uint32_t mask)
+{
+	uint32_t r;
+	__asm__ ("pextl %2, %1, %0" : "=r" (r) : "r" (x), "rm" (mask));
+	return r;
+}
+#endif
+
+/* A half interleave/ */
+static inline uint32_t gq_interleave_half(uint16_t x)
+{
+#ifdef GEOQUAD_BMI2
+	if (gq_use_bmi2)
+		return gq_pdep32(x, GEOQUAD_INTER32L);
+#endif
+	return ((uint32_t) gq_morton_forward[x >> 8] << 16) | gq_morton_forward[x & 0xFF];
+}
+
+/* A full interleave */
+static inline uint32_t gq_interleave_full(uint16_t x, uint16_t y)
+{
+	return gq_interleave_half(x) | (gq_interleave_half(y) << 1);
+}
+
+/* A half deinterleave */
+static inline uint16_t gq_deinterleave_half(uint32_t z)
+{
+#ifdef GEOQUAD_BMI2
+	if (gq_use_bmi2)
+		return (uint16_t) gq_pext32(z, GEOQUAD_INTER32L);
+#endif
+#ifdef GEOQUAD_SPARSE_DECODE
+	return gq_morton_sparse[z & 0x5555] | (gq_morton_sparse[(z >> 16) & 0x5555] << 8);
+#else
+	/* Compact the even bits with shifts and masks rather than a table, so
+	 * that decoding doesn't touch any memory. */
+	z &= GEOQUAD_INTER32L;
+	z = (z | (z >> 1)) & 0x33333333;
+	z = (z | (z >> 2)) & 0x0F0F0F0F;
+	z = (z | (z >> 4)) & 0x00FF00FF;
+	z = (z | (z >> 8)) & 0x0000FFFF;
+	return (uint16_t) z;
+#endif
+}
+
+/* Deinterleave z into x and y */
+static inline void gq_deinterleave_full(uint32_t z, uint16_t *x, uint16_t *y)
+{
+	*x = gq_deinterleave_half(z);
+	*y = gq_deinterleave_half(z>>1);
+}
+
+/* TODO: there's something fishy about these functions... */
+static inline double gq_half_to_lng(uint16_t lng16)
+{
+	return (lng16 * GEOQUAD_STEP) + (GEOQUAD_LONGITUDE_MIN / 2);
+}
+
+static inline double gq_half_to_lat(uint16_t lat16)
+{
+	return (lat16 * GEOQUAD_STEP) + (GEOQUAD_LATITUDE_MIN * 2);
+}
+
+static inline uint16_t gq_lng_to_half(double lng)
+{
+	return (uint16_t) ((lng - GEOQUAD_LONGITUDE_MIN) * GEOQUAD_INV);
+}
+
+static inline uint16_t gq_lat_to_half(double lat)
+{
+	return (uint16_t) ((lat - GEOQUAD_LATITUDE_MIN) * GEOQUAD_INV);
+}
+
+/* Written so that NaN is out of range */
+static inline int gq_lat_in_range(double lat)
+{
+	return (lat >= GEOQUAD_LATITUDE_MIN) && (lat <= GEOQUAD_LATITUDE_MAX);
+}
+
+static inline int gq_lng_in_range(double lng)
+{
+	return (lng >= GEOQUAD_LONGITUDE_MIN) && (lng <= GEOQUAD_LONGITUDE_MAX);
+}
+
+/* The geoquad containing (@lat, @lng), which must be in range */
+static inline uint32_t gq_create(double lat, double lng)
+{
+	return gq_interleave_full(gq_lat_to_half(lat), gq_lng_to_half(lng));
+}
+
+/* The SW corner of @geoquad, plus @offset degrees in each direction (half a
+ * step gives the center) */
+static inline void gq_parse(uint32_t geoquad, double offset, double *lat, double *lng)
+{
+	uint16_t half_lat, half_lng;
+
+	gq_deinterleave_full(geoquad, &half_lat, &half_lng);
+	*lat = ((half_lat * GEOQUAD_STEP) + GEOQUAD_LATITUDE_MIN) + offset;
+	*lng = ((half_lng * GEOQUAD_STEP) + GEOQUAD_LONGITUDE_MIN) + offset;
+}
+
+/***************************
+ * DIRECTIONAL FUNCTIONS
+ *
+ * These all take a qeoquad and return another geoquad north, south, east or
+ * west of the given geoquad. These functions are much faster than parsing and
+ * recreating a geoquad.
+ *
+ * TODO: as a small optimization, we could check here if the last digit needs
+ * to be flipped. This will be faster half of the time for "random" usage.
+ **************************/
+
+static inline uint32_t gq_northof(uint32_t gq)
+{
+	uint16_t lng = gq_deinterleave_half(gq >> 1);
+	return (gq & GEOQUAD_INTER32L) | (gq_interleave_half(lng + 1) << 1);
+}
+
+static inline uint32_t gq_southof(uint32_t gq)
+{
+	uint16_t lng = gq_deinterleave_half(gq >> 1);
+	return (gq & GEOQUAD_INTER32L) | (gq_interleave_half(lng - 1) << 1);
+}
+
+static inline uint32_t gq_eastof(uint32_t gq)
+{
+	uint16_t lat = gq_deinterleave_half(gq);
+	return (gq & GEOQUAD_INTER32M) | gq_interleave_half(lat + 1);
+}
+
+static inline uint32_t gq_westof(uint32_t gq)
+{
+	uint16_t lat = gq_deinterleave_half(gq);
+	return (gq & GEOQUAD_INTER32M) | gq_interleave_half(lat - 1);
+}
+
+/***************************
+ * DISTANCES
+ *
+ * All distances are in miles. The batch functions use SIMD kernels when
+ * gq_use_simd allows it (see libgeoquad.c for their accuracy).
+ **************************/
+
+#define GEOQUAD_SIMD_SCALAR  0
+#define GEOQUAD_SIMD_AVX2    1
+#define GEOQUAD_SIMD_AVX512  2
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEOQUAD_SIMD
+#endif
+
+extern int gq_have_simd;  /* the widest level the CPU supports */
+extern int gq_use_simd;   /* the level in use, at most gq_have_simd */
+
+double gq_haversine_distance(double lat1, double lng1, double lat2, double lng2);
+
+/* Distances between the pairs (lat1[i], lng1[i]) and (lat2[i], lng2[i]) */
+void gq_haversine_many(const double *lat1, const double *lng1, const double *lat2, const double *lng2, double *out, size_t n);
+
+/* Distances from (@lat, @lng) to each of (lats[i], lngs[i]) */
+void gq_distances_from(double lat, double lng, const double *lats, const double *lngs, double *out, size_t n);
+
+/* Sets mask[i] to whether (lats[i], lngs[i]) is within @radius of (@lat,
+ * @lng), returns the number that are */
+size_t gq_within_radius(double lat, double lng, double radius, const double *lats, const double *lngs, uint8_t *mask, size_t n);
+
+/***************************
+ * BATCH ENCODING
+ **************************/
+
+/* Geoquads for @n points, with errors[i] set to the GEOQUAD_BAD_* flags of
+ * point i (whose geoquad is then 0). Returns the number of invalid points. */
+size_t gq_create_many(const double *lats, const double *lngs, uint32_t *out, uint8_t *errors, size_t n);
+
+/* gq_parse for @n geoquads */
+void gq_decode_many(const uint32_t *gqs, double *lats, double *lngs, size_t n, double offset);
+
+/***************************
+ * NEARBY
+ *
+ * The geoquads within a radius (in miles) of a geoquad's SW corner, as
+ * columns of rows. With @fuzz the radius is grown by half a geoquad's
+ * diagonal, so that every geoquad touching the circle is included. Note
+ * that, as in the original Python implementation, the circle is computed
+ * with the lat and lng halves swapped, so it's only approximately round in
+ * real coordinates.
+ **************************/
+
+/* Computes the nearby cover of @geoquad as a halves array: the top rows of
+ * @count_out columns from @lng_w_out eastwards, followed by their bottom
+ * rows. The array is allocated with malloc and stored in @halves_out.
+ * Returns -1 if out of memory, or GEOQUAD_BAD_RADIUS. A negative radius gives
+ * an empty cover. */
+int gq_nearby_halves(uint32_t geoquad, double radius, int fuzz, uint16_t **halves_out, uint16_t *lng_w_out, size_t *count_out);
+
+/* The number of geoquads in a halves array of @len columns */
+size_t gq_nearby_total(const uint16_t halves[], size_t len);
+
+/* Writes the gq_nearby_total(halves, len) geoquads of a halves array to @out,
+ * column by column from the top */
+void gq_nearby_fill(const uint16_t halves[], uint16_t lng_w, size_t len, uint32_t *out);
+
+/* The nearby geoquads of @geoquad in a new array (to be freed with free),
+ * stored in @out. Returns how many there are, -1 if out of memory, or
+ * GEOQUAD_BAD_RADIUS. */
+ptrdiff_t gq_nearby(uint32_t geoquad, double radius, int fuzz, uint32_t **out);
+
+/* Enables or disables the cache of nearby shapes (see libgeoquad.c),
+ * clearing it either way. Returns the previous setting. */
+int gq_set_nearby_cache(int enable);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
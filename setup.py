@@ -9,8 +9,11 @@ define_macros = [('MODULE_VERSION', '"%s"' % __version__), ('DEBUG', None)]
  
 geoquad_extension = Extension(
 	name='geoquad',
-	sources=['geoquad.c'],
+	sources=['geoquad.c', 'libgeoquad.c'],
 	define_macros=define_macros,
+	# Needed for the distance kernels to vectorize: sqrt must not set errno
+	# and comparisons must be allowed to be if-converted.
+	extra_compile_args=['-fno-math-errno', '-fno-trapping-math'],
 )
  
 setup(
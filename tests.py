@@ -1,3 +1,8 @@
+import array
+import os
+import random
+import struct
+import tempfile
 import unittest
 import geoquad
 
@@ -47,7 +52,192 @@ class GeoquadTestCase(RatioTestCase):
 		g = geoquad.create(lat, lng)
 		assert len(geoquad.nearby(g, 10)) == 36
 		assert len(geoquad.nearby(g, 100)) == 2886
+
+	def test_nearby_cache(self):
+		# The ones next to the poles share a shape with the ones before them,
+		# but have it cut off at the edge of the grid
+		origins = [geoquad.create(lat, 20) for lat in (10, 10.5, 11, 30, 89.9, -89.9)] + [geoquad.create(lat, -75) for lat in (40, 41)]
+		prev = geoquad.set_nearby_cache(False)
+		try:
+			expected = [sorted(geoquad.nearby(g, r, fuzz)) for g in origins for r in (10, 100) for fuzz in (0, 1)]
+			geoquad.set_nearby_cache(True)
+			for _ in xrange(2):
+				assert [sorted(geoquad.nearby(g, r, fuzz)) for g in origins for r in (10, 100) for fuzz in (0, 1)] == expected
+		finally:
+			geoquad.set_nearby_cache(prev)
+
+	def test_nearby_empty(self):
+		g = geoquad.create(10, 20)
+		assert geoquad.nearby(g, -1) == []
+		assert len(geoquad.nearby(g, 0)) == 1
+
+	def test_nearby_bad_radius(self):
+		g = geoquad.create(10, 20)
+		gqs = array.array('I', [g])
+		for radius in (float('nan'), float('inf'), float('-inf')):
+			self.assertRaises(ValueError, geoquad.nearby, g, radius)
+			self.assertRaises(ValueError, geoquad.nearby, g, radius, out=array.array('I', [0] * 10))
+			self.assertRaises(ValueError, geoquad.nearby_count, g, radius)
+			self.assertRaises(ValueError, geoquad.iter_nearby, g, radius)
+			self.assertRaises(ValueError, geoquad.nearby_ranges, g, radius)
+			for mode in ('union', 'per_origin', 'ranges'):
+				self.assertRaises(ValueError, geoquad.nearby_many, gqs, radius, mode=mode)
+			self.assertRaises(ValueError, geoquad.nearby_annulus, g, radius, radius)
+			self.assertRaises(ValueError, geoquad.nearby_delta, g, geoquad.northof(g), radius)
+
+	def test_nearby_large(self):
+		# The column searches used to spin forever once the circle wrapped
+		# around past the edge of the grid
+		g = geoquad.create(10, 20)
+		assert geoquad.nearby_count(g, 9000) > geoquad.nearby_count(g, 5000)
+		# Next to the poles the columns used to wrap around onto invalid ones
+		for origin, radius in [((10, 179.9), 500), ((89.9, -179.9), 300), ((-89.9, 0), 200), ((-90, 20), 50)]:
+			quads = geoquad.nearby(geoquad.create(*origin), radius)
+			assert len(set(quads)) == len(quads)
+			for q in quads:
+				lat, lng = geoquad.parse(q)
+				assert geoquad.LATITUDE_MIN <= lat <= geoquad.LATITUDE_MAX, (origin, radius, lat)
+				assert geoquad.LONGITUDE_MIN <= lng <= geoquad.LONGITUDE_MAX, (origin, radius, lng)
+		# Bounded by the whole grid, and quick
+		total = (int(geoquad.LATITUDE_MAX - geoquad.LATITUDE_MIN) * 20 + 1) * (int(geoquad.LONGITUDE_MAX - geoquad.LONGITUDE_MIN) * 20 + 1)
+		assert geoquad.nearby_count(g, 1e5) <= total
+		assert geoquad.nearby_count(g, 1e9) <= total
+
+	def test_nearby_out(self):
+		g = geoquad.create(10, 20)
+		n = geoquad.nearby_count(g, 100)
+		assert n == 2886
+		out = array.array('I', [0] * (n + 1))
+		assert geoquad.nearby(g, 100, out=out) == n
+		assert sorted(out[:n]) == sorted(geoquad.nearby(g, 100))
+		assert out[n] == 0
+		self.assertRaises(ValueError, geoquad.nearby, g, 100, out=array.array('I', [0] * (n - 1)))
+
+	def test_nearby_many(self):
+		origins = [geoquad.create(10, 20), geoquad.create(10.3, 20.2), geoquad.create(-33.9, 151.2)]
+		gqs = array.array('I', origins)
+		covers = [sorted(geoquad.nearby(g, 30)) for g in origins]
+		union = geoquad.nearby_many(gqs, 30)
+		assert list(union) == sorted(set(q for c in covers for q in c))
+		quads, offsets = geoquad.nearby_many(gqs, 30, mode='per_origin')
+		assert len(offsets) == len(origins) + 1
+		assert [sorted(quads[offsets[i]:offsets[i + 1]]) for i in xrange(len(origins))] == covers
+		ranges = geoquad.nearby_many(gqs, 30, mode='ranges')
+		assert [q for lo, hi in ranges for q in xrange(lo, hi + 1)] == list(union)
+		assert len(geoquad.nearby_many(gqs, 30, mode='ranges', max_ranges=2)) == 2
+		self.assertRaises(ValueError, geoquad.nearby_many, gqs, 30, mode='bogus')
+
+	def test_iter_nearby(self):
+		g = geoquad.create(10, 20)
+		it = geoquad.iter_nearby(g, 100)
+		assert iter(it) is it
+		first = next(it)
+		quads = [first] + list(it)
+		assert sorted(quads) == sorted(geoquad.nearby(g, 100))
+		self.assertRaises(StopIteration, next, it)
+
+	def test_nearby_ranges(self):
+		g = geoquad.create(10, 20)
+		quads = geoquad.nearby(g, 100)
+		ranges = geoquad.nearby_ranges(g, 100)
+		assert set(quads) == set(q for lo, hi in ranges for q in xrange(lo, hi + 1))
+		assert all(a[1] + 1 < b[0] for a, b in zip(ranges, ranges[1:]))
+
+	def test_nearby_ranges_merged(self):
+		g = geoquad.create(10, 20)
+		quads = set(geoquad.nearby(g, 100))
+		ranges = geoquad.nearby_ranges(g, 100)
+		for max_ranges in (1, 10, len(ranges) - 1, len(ranges)):
+			merged = geoquad.nearby_ranges(g, 100, max_ranges=max_ranges)
+			assert len(merged) == max_ranges
+			assert quads <= set(q for lo, hi in merged for q in xrange(lo, hi + 1))
+			assert merged[0][0] == ranges[0][0] and merged[-1][1] == ranges[-1][1]
 	
+	def test_nearby_annulus(self):
+		g = geoquad.create(10, 20)
+		for r_inner, r_outer in [(0, 10), (10, 30), (30, 30), (-1, 5), (50, 100)]:
+			ring = geoquad.nearby_annulus(g, r_inner, r_outer)
+			expected = set(geoquad.nearby(g, r_outer)) - set(geoquad.nearby(g, r_inner))
+			assert len(ring) == len(expected) and set(ring) == expected
+		ring = set(geoquad.nearby_annulus(g, 10, 30))
+		assert set(geoquad.nearby_annulus(g, 10, 30, sector=(0, 360))) == ring
+		east = geoquad.nearby_annulus(g, 10, 30, sector=(0, 180))
+		west = geoquad.nearby_annulus(g, 10, 30, sector=(180, 0))
+		assert set(east) | set(west) == ring
+		assert all(geoquad.center(q)[1] > 20 for q in east if q not in west)
+		assert all(geoquad.center(q)[1] >= 20 for q in geoquad.nearby_annulus(g, 10, 30, sector=(0, 90)))
+		self.assertRaises(ValueError, geoquad.nearby_annulus, g, 30, 10)
+
+	def test_nearby_delta(self):
+		g = geoquad.create(10, 20)
+		for h in [geoquad.northof(g), geoquad.southof(g), geoquad.eastof(g), geoquad.westof(g), g, geoquad.create(10.5, 19.8)]:
+			old, new = set(geoquad.nearby(g, 30)), set(geoquad.nearby(h, 30))
+			added, removed = geoquad.nearby_delta(g, h, 30)
+			assert len(added) == len(new - old) and set(added) == new - old
+			assert len(removed) == len(old - new) and set(removed) == old - new
+
+	def test_nearby_threads(self):
+		import threading
+		rand = random.Random(7)
+		origins = [geoquad.create(rand.uniform(-60, 60), rand.uniform(-170, 170)) for _ in xrange(50)]
+		radii = [5, 25, 60]
+		expected = [sorted(geoquad.nearby(g, r)) for g in origins for r in radii]
+		results = []
+		def worker():
+			results.append([sorted(geoquad.nearby(g, r)) for g in origins for r in radii])
+		threads = [threading.Thread(target=worker) for _ in xrange(4)]
+		for t in threads:
+			t.start()
+		for t in threads:
+			t.join()
+		assert results == [expected] * 4
+
+	def test_bbox_cover(self):
+		def brute(south, west, north, east):
+			xs = xrange(int((south + 90) * 20), int((north + 90) * 20) + 1)
+			ys = xrange(int((west + 180) * 20), int((east + 180) * 20) + 1)
+			return set(geoquad.create(min(x * 0.05 - 89.975, 90), min(y * 0.05 - 179.975, 180)) for x in xs for y in ys)
+		for box in [(10, 20, 10.4, 21.1), (-3.3, -7.01, 1.2, 0.5), (0, 0, 0, 0), (40.1, 179.2, 40.5, -179.6)]:
+			ranges = geoquad.bbox_cover(*box)
+			assert all(a[1] + 1 < b[0] for a, b in zip(ranges, ranges[1:]))
+			quads = geoquad.bbox_cover(*box, as_ranges=False)
+			assert list(quads) == [q for lo, hi in ranges for q in xrange(lo, hi + 1)]
+			if box[1] <= box[3]:
+				assert set(quads) == brute(*box)
+			else:
+				assert set(quads) == brute(box[0], box[1], box[2], 180) | brute(box[0], -180, box[2], box[3])
+		assert len(geoquad.bbox_cover(10, 20, 11, 21, max_ranges=3)) == 3
+		self.assertRaises(ValueError, geoquad.bbox_cover, 11, 20, 10, 21)
+		self.assertRaises(ValueError, geoquad.bbox_cover, 10, 20, 91, 21)
+
+	def test_polygon_cover(self):
+		outer = [(10, 20), (10.6, 20.1), (10.9, 21.0), (10.1, 21.3)]
+		hole = [(10.3, 20.5), (10.5, 20.5), (10.4, 20.8)]
+		other = [(-5, -5), (-5.2, -4.6), (-4.8, -4.7)]
+		rings = [outer, hole, other]
+		def inside(lat, lng):
+			n = 0
+			for ring in rings:
+				for (a, b), (c, d) in zip(ring, ring[1:] + ring[:1]):
+					if (a <= lat) != (c <= lat) and lng < b + (lat - a) * (d - b) / float(c - a):
+						n += 1
+			return n % 2 == 1
+		interior, boundary = geoquad.polygon_cover(rings)
+		assert list(interior) == sorted(interior) and list(boundary) == sorted(boundary)
+		assert not set(interior) & set(boundary)
+		for ring in rings:
+			assert set(geoquad.create(lat, lng) for lat, lng in ring) <= set(boundary)
+		for g in interior:
+			lat, lng = geoquad.center(g)
+			assert all(inside(lat + a, lng + b) for a in (-0.024, 0.024) for b in (-0.024, 0.024))
+		covered = set(interior) | set(boundary)
+		for box in [(9.9, 19.9, 11, 21.4), (-5.3, -5.1, -4.7, -4.5)]:
+			for g in geoquad.bbox_cover(*box, as_ranges=False):
+				if inside(*geoquad.center(g)):
+					assert g in covered
+		self.assertRaises(ValueError, geoquad.polygon_cover, [outer[:2]])
+		self.assertRaises(ValueError, geoquad.polygon_cover, [[(0, 0), (91, 0), (0, 1)]])
+
 	def test_haversine_increasing(self):
 		'''
 		Test that haversine distance increases when any point is stretched from
@@ -74,5 +264,410 @@ class GeoquadTestCase(RatioTestCase):
 			b[i] = 0.5 * v
 			assert geoquad.haversine_distance(*make_tuple(b)) < d
 
+class BatchTestCase(unittest.TestCase):
+
+	coords = [(10.01, 20.01), (-45.5, 170.25), (89.99, -179.99), (0, 0), (37.77, -122.42)]
+
+	def test_create_many(self):
+		lats = array.array('d', [c[0] for c in self.coords])
+		lngs = array.array('d', [c[1] for c in self.coords])
+		gqs, errors = geoquad.create_many(lats, lngs)
+		assert list(gqs) == [geoquad.create(*c) for c in self.coords]
+		assert not any(bytearray(errors))
+
+	def test_create_many_out(self):
+		lats = array.array('d', [c[0] for c in self.coords])
+		lngs = array.array('d', [c[1] for c in self.coords])
+		out = array.array('I', [0] * len(self.coords))
+		gqs, errors = geoquad.create_many(lats, lngs, out=out)
+		assert gqs is out
+		assert list(out) == [geoquad.create(*c) for c in self.coords]
+		self.assertRaises(ValueError, geoquad.create_many, lats, lngs, array.array('I'))
+		self.assertRaises(TypeError, geoquad.create_many, lats, lngs, array.array('d', lats))
+
+	def test_create_many_errors(self):
+		nan = float('nan')
+		lats = array.array('d', [10, 91, 10, -91, nan, 10])
+		lngs = array.array('d', [20, 20, 181, 181, 20, nan])
+		gqs, errors = geoquad.create_many(lats, lngs)
+		assert list(errors) == [0, geoquad.BAD_LATITUDE, geoquad.BAD_LONGITUDE, geoquad.BAD_LATITUDE | geoquad.BAD_LONGITUDE,
+			geoquad.BAD_LATITUDE, geoquad.BAD_LONGITUDE]
+		assert gqs[0] == geoquad.create(10, 20)
+		assert list(gqs[1:]) == [0] * 5
+		self.assertRaises(ValueError, geoquad.create_many, lats, lngs[:2])
+		self.assertRaises(ValueError, geoquad.create, nan, 20)
+		self.assertRaises(ValueError, geoquad.create, 10, nan)
+
+	def test_untyped_buffer(self):
+		# A str is a buffer too, but has no item type to check
+		self.assertRaises(TypeError, geoquad.create_many, 'x' * 16, 'y' * 16)
+		self.assertRaises(TypeError, geoquad.distances_from, (10, 20), 'x' * 16, 'y' * 16)
+
+	def test_parse_many(self):
+		gqs = array.array('I', [geoquad.create(*c) for c in self.coords])
+		lats, lngs = geoquad.parse_many(gqs)
+		assert list(zip(lats, lngs)) == [geoquad.parse(g) for g in gqs]
+
+	def test_center_many(self):
+		gqs = array.array('I', [geoquad.create(*c) for c in self.coords])
+		lats = array.array('d', [0] * len(gqs))
+		lngs = array.array('d', [0] * len(gqs))
+		lats_, lngs_ = geoquad.center_many(gqs, lats, lngs)
+		assert lats_ is lats and lngs_ is lngs
+		assert list(zip(lats, lngs)) == [geoquad.center(g) for g in gqs]
+
+	def test_num_threads(self):
+		rand = random.Random(3)
+		n = 100003
+		lats = array.array('d', [rand.uniform(-90, 90) for _ in xrange(n)])
+		lngs = array.array('d', [rand.uniform(-180, 180) for _ in xrange(n)])
+		lats[5000] = 91
+		def run():
+			gqs, errors = geoquad.create_many(lats, lngs)
+			return [gqs, errors, geoquad.center_many(gqs), geoquad.haversine_many(lats, lngs, lngs, lats),
+				geoquad.distances_from((10, 20), lats, lngs), geoquad.within_radius((10, 20), 3000, lats, lngs, indices=True),
+				geoquad.nearby_many(gqs[:500], 30, mode='per_origin'), geoquad.nearby_many(gqs[:500], 30)]
+		prev = geoquad.set_num_threads(1)
+		try:
+			assert geoquad.get_num_threads() == 1
+			expected = run()
+			geoquad.set_num_threads(4)
+			assert geoquad.get_num_threads() == 4
+			assert run() == expected
+			pid = os.fork()
+			if not pid:
+				try:
+					os._exit(run() != expected)
+				finally:
+					os._exit(2)
+			assert os.waitpid(pid, 0)[1] == 0
+			self.assertRaises(ValueError, geoquad.set_num_threads, -1)
+		finally:
+			geoquad.set_num_threads(prev)
+
+	def test_resize_during_call(self):
+		# array.array only has the old buffer interface, so nothing stops
+		# another thread resizing it while a kernel runs without the GIL.
+		# Big inputs are copied first, small ones keep the GIL.
+		for n in (100000, 500):
+			self.check_resize(n)
+
+	def check_resize(self, n):
+		import threading
+		pts = array.array('d', [10.0] * n)
+		out = array.array('d', [0.0] * (2 * n))
+		d = geoquad.haversine_distance((20, 30), (10, 10))
+		stop = []
+		def resize():
+			while not stop:
+				pts.extend(pts[:n])
+				out.extend(out[:n])
+				del pts[n:]
+				del out[2 * n:]
+		t = threading.Thread(target=resize)
+		t.start()
+		try:
+			for _ in xrange(10):
+				assert all(abs(x - d) < 1e-6 for x in geoquad.distances_from((20, 30), pts, pts))
+				geoquad.distances_from((20, 30), pts, pts, out=out)
+				assert all(abs(x - d) < 1e-6 for x in out[:n])
+		finally:
+			stop.append(1)
+			t.join()
+
+class HaversineManyTestCase(unittest.TestCase):
+
+	def random_pairs(self, n, antipodal=False):
+		rand = random.Random(n)
+		cols = [array.array('d') for _ in xrange(4)]
+		for _ in xrange(n):
+			lat, lng = rand.uniform(-90, 90), rand.uniform(-180, 180)
+			if antipodal:
+				lat2, lng2 = -lat, lng + (180 if lng < 0 else -180)
+			else:
+				lat2, lng2 = rand.uniform(-90, 90), rand.uniform(-180, 180)
+			for col, v in zip(cols, (lat, lng, lat2, lng2)):
+				col.append(v)
+		return cols
+
+	def simd_levels(self):
+		'''Yields each SIMD level the CPU supports, with it in use.'''
+		prev = geoquad.set_simd(geoquad.SIMD)
+		try:
+			for level in ('scalar', 'avx2', 'avx512'):
+				try:
+					geoquad.set_simd(level)
+				except ValueError:
+					continue
+				yield level
+		finally:
+			geoquad.set_simd(prev)
+
+	def check_levels(self, cols, max_error):
+		expected = [geoquad.haversine_distance((a, b), (c, d)) for a, b, c, d in zip(*cols)]
+		wide = []
+		for level in self.simd_levels():
+			out = geoquad.haversine_many(*cols)
+			error = max(abs(a - b) for a, b in zip(out, expected))
+			assert error <= max_error, '%s error %g' % (level, error)
+			if level != 'scalar':
+				wide.append(out)
+		# The AVX2 and AVX-512 kernels are the same code, compiled the same way
+		assert all(out == wide[0] for out in wide)
+
+	def test_random(self):
+		self.check_levels(self.random_pairs(10000), 1e-8)
+
+	def test_nearby_points(self):
+		lat1, lng1, lat2, lng2 = self.random_pairs(1000)
+		self.check_levels((lat1, lng1, lat1, array.array('d', [x + 1e-4 for x in lng1])), 1e-8)
+
+	def test_antipodal(self):
+		self.check_levels(self.random_pairs(1000, antipodal=True), 1e-3)
+
+	def test_distances_from(self):
+		lat1, lng1, lats, lngs = self.random_pairs(1000)
+		origin = (37.77, -122.42)
+		expected = [geoquad.haversine_distance(origin, p) for p in zip(lats, lngs)]
+		for level in self.simd_levels():
+			out = geoquad.distances_from(origin, lats, lngs)
+			assert max(abs(a - b) for a, b in zip(out, expected)) <= 1e-8, level
+
+	def test_within_radius(self):
+		rand = random.Random(0)
+		lats = array.array('d', [rand.uniform(35, 40) for _ in xrange(2000)])
+		lngs = array.array('d', [rand.uniform(-125, -120) for _ in xrange(2000)])
+		origin = (37.77, -122.42)
+		distances = [geoquad.haversine_distance(origin, p) for p in zip(lats, lngs)]
+		same = array.array('d', [origin[0]] * 8), array.array('d', [origin[1]] * 8)
+		for level in self.simd_levels():
+			mask = geoquad.within_radius(origin, 100, lats, lngs)
+			assert list(mask) == [int(d <= 100) for d in distances]
+			indices = geoquad.within_radius(origin, 100, lats, lngs, indices=True)
+			assert list(indices) == [i for i, d in enumerate(distances) if d <= 100]
+			assert all(geoquad.within_radius(origin, 20000, lats, lngs))
+			assert all(geoquad.within_radius(origin, 0, *same))
+			assert not any(geoquad.within_radius(origin, -10, *same))
+			assert not any(geoquad.within_radius(origin, float('nan'), *same))
+
+	def test_out(self):
+		lat1, lng1, lat2, lng2 = self.random_pairs(10)
+		out = array.array('d', [0] * 10)
+		assert geoquad.haversine_many(lat1, lng1, lat2, lng2, out) is out
+		self.assertRaises(ValueError, geoquad.haversine_many, lat1, lng1, lat2, lng2[:5])
+
+class GeoIndexTestCase(unittest.TestCase):
+
+	def setUp(self):
+		rand = random.Random(7)
+		points = [(rand.uniform(-90, 90), rand.uniform(-180, 180)) for _ in xrange(2000)]
+		for lat, lng in [(89.9, 0), (0, 179.99), (60, -179.9), (-45, 10)]:
+			points += [(max(-90, min(90, lat + rand.uniform(-2, 2))), (lng + rand.uniform(-3, 3) + 180) % 360 - 180) for _ in xrange(500)]
+		self.points = points
+		self.ids = array.array('l', [i * 3 for i in xrange(len(points))])
+		self.index = geoquad.GeoIndex(self.ids, array.array('d', [p[0] for p in points]), array.array('d', [p[1] for p in points]))
+
+	def test_query_radius(self):
+		assert len(self.index) == len(self.points)
+		for lat, lng in [(89.9, 0), (90, 0), (0, 179.99), (0, -180), (60, -179.9), (-45, 10), (-89, 45)]:
+			distances = [geoquad.haversine_distance((lat, lng), p) for p in self.points]
+			for radius in [0, 5, 40, 150, 1000]:
+				expected = sorted(self.ids[i] for i, d in enumerate(distances) if d <= radius)
+				assert sorted(self.index.query_radius(lat, lng, radius)) == expected
+		assert len(self.index.query_radius(0, 0, 13000)) == len(self.points)
+
+	def test_knn(self):
+		for lat, lng in [(89.9, 0), (0, 179.99), (60, -179.9), (-45, 10), (30, 30)]:
+			distances = sorted((geoquad.haversine_distance((lat, lng), p), self.ids[i]) for i, p in enumerate(self.points))
+			for k in [1, 10, 100]:
+				ids, dists = self.index.knn(lat, lng, k)
+				assert len(ids) == len(dists) == k
+				assert list(dists) == [d for d, _ in distances[:k]]
+				by_id = dict((i, d) for d, i in distances)
+				assert len(set(ids)) == k and [by_id[i] for i in ids] == list(dists)
+		small = geoquad.GeoIndex(array.array('l', [5, 6, 7]), array.array('d', [1, 2, 3]), array.array('d', [1, 1, 1]))
+		assert list(small.knn(1.1, 1, 10)[0]) == [5, 6, 7]
+		assert self.index.knn(0, 0, 0) == (array.array('l'), array.array('d'))
+
+	def test_save_load(self):
+		fd, path = tempfile.mkstemp()
+		os.close(fd)
+		try:
+			self.index.save(path)
+			loaded = geoquad.GeoIndex.load(path)
+			assert len(loaded) == len(self.index)
+			for lat, lng in [(89.9, 0), (-45, 10)]:
+				assert loaded.query_radius(lat, lng, 150) == self.index.query_radius(lat, lng, 150)
+				assert loaded.knn(lat, lng, 20) == self.index.knn(lat, lng, 20)
+			# Saving over a mapped file replaces it rather than rewriting it
+			# under the mapping
+			geoquad.GeoIndex(array.array('l', [1]), array.array('d', [0.0]), array.array('d', [0.0])).save(path)
+			assert len(loaded) == len(self.index)
+			assert loaded.query_radius(-45, 10, 150) == self.index.query_radius(-45, 10, 150)
+			assert len(geoquad.GeoIndex.load(path)) == 1
+			assert [f for f in os.listdir(os.path.dirname(path)) if f.startswith(os.path.basename(path) + '.tmp')] == []
+			self.index.save(path)
+			del loaded
+			with open(path, 'r+b') as f:
+				# Push an offset past n
+				header = struct.unpack('8sIIQQ5QQ', f.read(struct.calcsize('8sIIQQ5QQ')))
+				f.seek(header[6] + 8)
+				f.write(struct.pack('Q', header[3] + 100))
+			self.assertRaises(ValueError, geoquad.GeoIndex.load, path)
+			with open(path, 'r+b') as f:
+				f.truncate(os.path.getsize(path) - 64)
+			self.assertRaises(ValueError, geoquad.GeoIndex.load, path)
+			with open(path, 'wb') as f:
+				f.write('not an index' * 20)
+			self.assertRaises(ValueError, geoquad.GeoIndex.load, path)
+		finally:
+			os.unlink(path)
+		self.assertRaises(IOError, geoquad.GeoIndex.load, path)
+
+	def test_threads(self):
+		lats = array.array('d', [p[0] for p in self.points])
+		lngs = array.array('d', [p[1] for p in self.points])
+		paths = []
+		try:
+			for threads in (1, 3, 64):
+				fd, path = tempfile.mkstemp()
+				os.close(fd)
+				paths.append(path)
+				geoquad.GeoIndex(self.ids, lats, lngs, threads=threads).save(path)
+			self.index.save(paths[0] + '.default')
+			paths.append(paths[0] + '.default')
+			contents = [open(path, 'rb').read() for path in paths]
+			assert all(c == contents[0] for c in contents)
+		finally:
+			for path in paths:
+				os.unlink(path)
+		lats[1234] = 100
+		self.assertRaises(ValueError, geoquad.GeoIndex, self.ids, lats, lngs, threads=3)
+
+	def test_invalid(self):
+		self.assertRaises(ValueError, geoquad.GeoIndex, self.ids, array.array('d', [0]), array.array('d', [0]))
+		self.assertRaises(ValueError, geoquad.GeoIndex, array.array('l', [1]), array.array('d', [91]), array.array('d', [0]))
+		self.assertRaises(ValueError, self.index.query_radius, 0, 181, 10)
+		self.assertRaises(ValueError, self.index.query_radius, 10, 20, -1)
+		self.assertRaises(ValueError, self.index.query_radius, 10, 20, float('nan'))
+
+class DynamicGeoIndexTestCase(unittest.TestCase):
+
+	def check(self, index, points):
+		assert len(index) == len(points)
+		for lat, lng, radius in [(10, 20, 300), (0, 179.9, 200), (89.5, 0, 100), (-30, -60, 2000)]:
+			expected = sorted(i for i, p in points.iteritems() if geoquad.haversine_distance((lat, lng), p) <= radius)
+			assert list(index.query_radius(lat, lng, radius)) == expected
+
+	def test_updates(self):
+		rand = random.Random(3)
+		index = geoquad.DynamicGeoIndex()
+		points = {}
+		for _ in xrange(20000):
+			i = rand.randrange(3000)
+			op = rand.random()
+			if op < 0.2:
+				assert index.delete(i) == (i in points)
+				points.pop(i, None)
+			elif op < 0.5 and i in points:
+				lat, lng = points[i]
+				points[i] = (max(-90, min(90, lat + rand.uniform(-0.1, 0.1))), max(-180, min(180, lng + rand.uniform(-0.1, 0.1))))
+				index.insert(i, *points[i])
+			else:
+				cluster = rand.choice([(10, 20), (0, 179.9), (89.5, 0), (-30, -60)])
+				points[i] = (max(-90, min(90, cluster[0] + rand.uniform(-3, 3))), max(-180, min(180, cluster[1] + rand.uniform(-3, 3))))
+				index.insert(i, *points[i])
+		self.check(index, points)
+		self.assertRaises(ValueError, index.insert, 1, 91, 0)
+		self.assertRaises(ValueError, index.insert, 3, float('nan'), 0)
+		self.assertRaises(ValueError, index.query_radius, 10, 20, -1)
+		self.assertRaises(ValueError, index.query_radius, 10, 20, float('nan'))
+
+	def test_threads(self):
+		import threading
+		index = geoquad.DynamicGeoIndex()
+		results = []
+		def worker(seed):
+			rand = random.Random(seed)
+			points = {}
+			for _ in xrange(5000):
+				i = seed * 100000 + rand.randrange(500)
+				if rand.random() < 0.2:
+					index.delete(i)
+					points.pop(i, None)
+				else:
+					points[i] = (rand.uniform(5, 15), rand.uniform(15, 25))
+					index.insert(i, *points[i])
+			results.append(points)
+		threads = [threading.Thread(target=worker, args=(seed,)) for seed in xrange(4)]
+		for t in threads:
+			t.start()
+		for t in threads:
+			t.join()
+		points = {}
+		for p in results:
+			points.update(p)
+		self.check(index, points)
+
+	def test_move_during_query(self):
+		import threading
+		index = geoquad.DynamicGeoIndex()
+		for i in xrange(1000):
+			index.insert(i, 10, 20)
+		done = []
+		def mover():
+			rand = random.Random(4)
+			while not done:
+				index.insert(rand.randrange(1000), *rand.choice([(10, 20), (-10, -20)]))
+		t = threading.Thread(target=mover)
+		t.start()
+		try:
+			for _ in xrange(200):
+				found = list(index.query_radius(0, 0, 13000))
+				assert len(set(found)) == len(found)
+		finally:
+			done.append(True)
+			t.join()
+
+class InterleaveTestCase(unittest.TestCase):
+
+	def test_bmi2_matches_table(self):
+		if not geoquad.HAVE_BMI2:
+			self.skipTest('the CPU has no BMI2')
+		halves = range(1 << 16)
+		lats = array.array('d', [h * geoquad.GEOQUAD_STEP - 90 for h in halves if h * geoquad.GEOQUAD_STEP <= 180])
+		lngs = array.array('d', [h * geoquad.GEOQUAD_STEP - 180 for h in halves[:len(lats)]])
+		prev = geoquad.set_bmi2(False)
+		try:
+			table, _ = geoquad.create_many(lats, lngs)
+			table_lats, table_lngs = geoquad.parse_many(table)
+			geoquad.set_bmi2(True)
+			bmi2, _ = geoquad.create_many(lats, lngs)
+			bmi2_lats, bmi2_lngs = geoquad.parse_many(bmi2)
+			gqs = array.array('I', xrange(0, 1 << 32, 65537))
+			bmi2_parsed = geoquad.parse_many(gqs)
+			geoquad.set_bmi2(False)
+			table_parsed = geoquad.parse_many(gqs)
+		finally:
+			geoquad.set_bmi2(prev)
+		assert table == bmi2
+		assert table_lats == bmi2_lats and table_lngs == bmi2_lngs
+		assert table_parsed == bmi2_parsed
+
+class TableInterleaveMixin(object):
+	'''Runs a test case with the lookup table interleave path.'''
+
+	def setUp(self):
+		self._bmi2 = geoquad.set_bmi2(False)
+
+	def tearDown(self):
+		geoquad.set_bmi2(self._bmi2)
+
+class TableGeoquadTestCase(TableInterleaveMixin, GeoquadTestCase):
+	pass
+
+class TableBatchTestCase(TableInterleaveMixin, BatchTestCase):
+	pass
+
 if __name__ == '__main__':
 	unittest.main()